@@ -0,0 +1,199 @@
+#pragma once
+
+#include "primitives.h"
+
+namespace grid {
+
+    // Points bucketed into a uniform grid over their bounding box, with about
+    // two points per cell. Cells are packed one after another, row by row:
+    // the points of cell i are cellPoints[starts[i]] up to cellPoints[starts[i + 1]],
+    // so a run of cells in a row is one run of points.
+    //
+    // Searches only visit the cells a query overlaps, and nearest() walks
+    // rings of cells around the query until the next ring is farther than
+    // the k-th point found. That makes them about O(1) on roughly uniform
+    // data, while clustered data crowds a few cells.
+    //
+    // The grid is laid out again for the new size once the number of points
+    // doubles or one falls outside it. Between that, putting a point shifts
+    // the cells after its own, which is linear in the size; build() adds many
+    // at once.
+    class PointSet {
+    public:
+
+        using ForwardIt = Iterator;
+
+        PointSet() = default;
+
+        template<class InputIt>
+        PointSet(InputIt first, InputIt last) {
+            build(first, last);
+        }
+
+        bool empty() const {
+            return cellPoints.empty();
+        }
+
+        std::size_t size() const {
+            return cellPoints.size();
+        }
+
+        void put(const Point &p);
+
+        // Adds the points and lays out the grid once. Iteration keeps the
+        // order they came in, like after putting them one by one.
+        template<class InputIt>
+        void build(InputIt first, InputIt last) {
+            std::vector<Point> all(begin(), end());
+            appendNew(all, first, last);
+            points = std::make_shared<std::vector<Point>>(std::move(all));
+            layOut();
+        }
+
+        bool contains(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> range(const Rect &r) const {
+            std::vector<Point> result;
+            range(r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt range(const Rect &r, OutputIt out) const {
+            for_each_in_range(r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point inside r
+        template<class F>
+        void for_each_in_range(const Rect &r, F &&f) const {
+            if (cellPoints.empty() || r.xmin() > r.xmax() || r.ymin() > r.ymax()) {
+                return;
+            }
+            std::size_t left = column(r.xmin()), right = column(r.xmax());
+            for (std::size_t y = row(r.ymin()); y <= row(r.ymax()); ++y) {
+                for (std::uint32_t i = starts[y * side + left]; i < starts[y * side + right + 1]; ++i) {
+                    if (r.contains(cellPoints[i])) {
+                        f(cellPoints[i]);
+                    }
+                }
+            }
+        }
+
+        // Points at most r away from center
+        std::pair<ForwardIt, ForwardIt> within(const Point &center, double r) const {
+            std::vector<Point> result;
+            within(center, r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt within(const Point &center, double r, OutputIt out) const {
+            for_each_within(center, r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point at most r away from center, visiting the cells of the square around the circle
+        template<class F>
+        void for_each_within(const Point &center, double r, F &&f) const {
+            if (r < 0 || cellPoints.empty()) {
+                return;
+            }
+            // Bounds widened by an ulp, since rounding them may lose a cell
+            // holding points right on the circle
+            auto below = [](double v) { return std::nextafter(v, -std::numeric_limits<double>::infinity()); };
+            auto above = [](double v) { return std::nextafter(v, std::numeric_limits<double>::infinity()); };
+            std::size_t left = column(below(center.x() - r)), right = column(above(center.x() + r));
+            std::size_t bottom = row(below(center.y() - r)), top = row(above(center.y() + r));
+            for (std::size_t y = bottom; y <= top; ++y) {
+                for (std::uint32_t i = starts[y * side + left]; i < starts[y * side + right + 1]; ++i) {
+                    if (cellPoints[i].squaredDistance(center) <= r * r) {
+                        f(cellPoints[i]);
+                    }
+                }
+            }
+        }
+
+        ForwardIt begin() const {
+            return Iterator(points, 0);
+        }
+
+        ForwardIt end() const {
+            return Iterator(points, points->size());
+        }
+
+        std::optional<Point> nearest(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const {
+            std::vector<Point> result;
+            nearest(p, k, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Writes the k nearest points to out, the closest first
+        template<class OutputIt>
+        OutputIt nearest(const Point &p, std::size_t k, OutputIt out) const {
+            for (const Point &point : nearestPoints(p, k)) {
+                *out++ = point;
+            }
+            return out;
+        }
+
+        friend std::ostream &operator<<(std::ostream &os, const PointSet &pointSet) {
+            os << "{";
+            for (auto point = pointSet.begin(); point != pointSet.end(); ++point) {
+                os << *point;
+            }
+            os << "}";
+            return os;
+        }
+
+    private:
+        // Cell coordinates, clamped to the grid so that queries outside it work too
+        std::size_t column(double x) const {
+            return clamp((x - frame.xmin()) * xScale);
+        }
+
+        std::size_t row(double y) const {
+            return clamp((y - frame.ymin()) * yScale);
+        }
+
+        std::size_t clamp(double c) const {
+            if (!(c > 0)) {
+                return 0;
+            }
+            return c >= double(side) ? side - 1 : static_cast<std::size_t>(c);
+        }
+
+        std::size_t cellOf(const Point &p) const {
+            return row(p.y()) * side + column(p.x());
+        }
+
+        // Fits the grid to the points and sorts them into its cells
+        void layOut();
+
+        std::vector<Point> nearestPoints(const Point &p, std::size_t k) const;
+
+        // Copies the points first if an iterator or a copy of the set still shares them
+        std::vector<Point> &ownPoints() {
+            if (points.use_count() > 1) {
+                points = std::make_shared<std::vector<Point>>(*points);
+            }
+            return *points;
+        }
+
+        // Bounding box of the points when the grid was laid out
+        Rect frame;
+        // Cells per axis and per unit of each coordinate
+        std::size_t side = 0;
+        double xScale = 0;
+        double yScale = 0;
+        // Number of points the grid was laid out for
+        std::size_t laidOutFor = 0;
+        std::vector<std::uint32_t> starts;
+        std::vector<Point> cellPoints;
+        // Points in the order of insertion, shared with begin() and end()
+        std::shared_ptr<std::vector<Point>> points = std::make_shared<std::vector<Point>>();
+    };
+
+}
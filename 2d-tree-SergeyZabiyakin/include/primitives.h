@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <cstdint>
 #include <ostream>
 #include <optional>
 #include <vector>
@@ -8,11 +9,20 @@
 #include <algorithm>
 #include <map>
 #include <functional>
+#include <numeric>
+#include <iterator>
 #include <stack>
 #include <iostream>
 #include <set>
 #include <limits>
-#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <array>
+#include <type_traits>
+#include <utility>
+
+#include "simd.h"
+#include "workers.h"
 
 class Point {
 public:
@@ -35,8 +45,20 @@ public:
         return this->Y;
     }
 
+    // Coordinate on the given axis, 0 for x and 1 for y
+    double operator[](std::size_t axis) const {
+        return axis == 0 ? X : Y;
+    }
+
     double distance(const Point &p) const {
-        return sqrt(pow(X - p.x(), 2) + pow(Y - p.y(), 2));
+        return std::sqrt(squaredDistance(p));
+    }
+
+    // Cheaper than distance() and ordered the same way, so searches compare these
+    double squaredDistance(const Point &p) const {
+        double dx = X - p.x();
+        double dy = Y - p.y();
+        return dx * dx + dy * dy;
     }
 
     bool operator<(const Point &p) const {
@@ -76,6 +98,8 @@ private:
 class Rect {
 public:
 
+    Rect() : Rect(Point(), Point()) {}
+
     Rect(const Point &left_bottom, const Point &right_top) {
         Xmin = left_bottom.x();
         Ymin = left_bottom.y();
@@ -99,33 +123,51 @@ public:
         return Ymax;
     }
 
+    // Bounds on the given axis, 0 for x and 1 for y
+    double lower(std::size_t axis) const {
+        return axis == 0 ? Xmin : Ymin;
+    }
+
+    double upper(std::size_t axis) const {
+        return axis == 0 ? Xmax : Ymax;
+    }
+
     double distance(const Point &p) const {
-        if (contains(p)) return 0;
-        if (p.x() >= Xmin && p.x() <= Xmax) {
-            return std::min(std::abs(p.y() - Ymin), std::abs(p.y() - Ymax));
-        }
-        if (p.y() >= Ymin && p.y() <= Ymax) {
-            return std::min(std::abs(p.x() - Xmin), std::abs(p.x() - Xmax));
-        }
-        return std::min(std::min(Point(xmin(), ymin()).distance(p),
-                                 Point(xmax(), ymin()).distance(p)),
-                        std::min(Point(xmin(), ymax()).distance(p),
-                                 Point(xmax(), ymax()).distance(p)));
+        return std::sqrt(squaredDistance(p));
+    }
+
+    // Squared distance to the point of the rectangle closest to p
+    double squaredDistance(const Point &p) const {
+        double dx = p.x() < Xmin ? Xmin - p.x() : (p.x() > Xmax ? p.x() - Xmax : 0);
+        double dy = p.y() < Ymin ? Ymin - p.y() : (p.y() > Ymax ? p.y() - Ymax : 0);
+        return dx * dx + dy * dy;
     }
 
     bool contains(const Point &p) const {
         return p.x() >= Xmin && p.x() <= Xmax && p.y() >= Ymin && p.y() <= Ymax;
     }
 
+    bool contains(const Rect &r) const {
+        return r.xmin() >= Xmin && r.xmax() <= Xmax && r.ymin() >= Ymin && r.ymax() <= Ymax;
+    }
+
+    // Overlapping on both axes also catches two rectangles crossing each
+    // other, which have no corner inside one another
     bool intersects(const Rect &r) const {
-        return contains(Point(r.xmin(), r.ymin()))
-               || contains(Point(r.xmax(), r.ymin()))
-               || contains(Point(r.xmin(), r.ymax()))
-               || contains(Point(r.xmax(), r.ymax()))
-               || r.contains(Point(xmin(), ymin()))
-               || r.contains(Point(xmax(), ymin()))
-               || r.contains(Point(xmin(), ymax()))
-               || r.contains(Point(xmax(), ymax()));
+        return r.xmin() <= Xmax && r.xmax() >= Xmin && r.ymin() <= Ymax && r.ymax() >= Ymin;
+    }
+
+    bool operator==(const Rect &r) const {
+        return Xmin == r.xmin() && Ymin == r.ymin() && Xmax == r.xmax() && Ymax == r.ymax();
+    }
+
+    bool operator!=(const Rect &r) const {
+        return !(*this == r);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Rect &r) {
+        os << "[" << Point(r.xmin(), r.ymin()) << " , " << Point(r.xmax(), r.ymax()) << "]";
+        return os;
     }
 
     std::pair<std::optional<Rect>, std::optional<Rect>> splitX(double x) const {
@@ -157,64 +199,440 @@ private:
     double Ymax;
 };
 
-class Iterator : public std::iterator<std::forward_iterator_tag, Point> {
+// Whether f(axis) holds for all of the Dim axes, the loop unrolled at compile time
+template<class F, std::size_t... Axes>
+bool allAxes(F &&f, std::index_sequence<Axes...>) {
+    return (f(Axes) && ...);
+}
+
+template<std::size_t Dim, class F>
+bool allAxes(F &&f) {
+    return allAxes(f, std::make_index_sequence<Dim>());
+}
+
+// Sum of f(axis) over the Dim axes, the loop unrolled at compile time
+template<class F, std::size_t... Axes>
+double sumAxes(F &&f, std::index_sequence<Axes...>) {
+    return (f(Axes) + ...);
+}
+
+template<std::size_t Dim, class F>
+double sumAxes(F &&f) {
+    return sumAxes(f, std::make_index_sequence<Dim>());
+}
+
+// Point with Dim coordinates of type Scalar for the generic kd-tree. The
+// 2-d double case is Point itself.
+template<std::size_t Dim, class Scalar>
+class BasicPoint {
 public:
-    Iterator(std::vector<Point> vec, std::size_t c = 0) : vector(std::move(vec)) {
-        cur = c;
+    BasicPoint() : coords() {
     }
 
-    Iterator() {
-        cur = 0;
+    explicit BasicPoint(const std::array<Scalar, Dim> &coords) : coords(coords) {
     }
 
-    Iterator(const Iterator &it) : vector(it.vector) {
-        cur = it.cur;
+    template<class... T, class = std::enable_if_t<sizeof...(T) == Dim && Dim != 1>>
+    BasicPoint(T... c) : coords{static_cast<Scalar>(c)...} {
     }
 
-    Iterator(const Iterator &it, std::size_t c ) : vector(it.vector) {
-        cur = c;
+    Scalar operator[](std::size_t axis) const {
+        return coords[axis];
     }
 
-    const Point &operator*() const {
-        return vector[cur];
+    double distance(const BasicPoint &p) const {
+        return std::sqrt(squaredDistance(p));
     }
 
-    const Point *operator->() const {
-        return &vector[cur];
+    // Computed in double whatever the coordinates are stored in
+    double squaredDistance(const BasicPoint &p) const {
+        return sumAxes<Dim>([&](std::size_t axis) {
+            double d = double(coords[axis]) - double(p[axis]);
+            return d * d;
+        });
     }
 
-    Iterator &operator++() {
-        ++cur;
-        return *this;
+    bool operator<(const BasicPoint &p) const {
+        return coords < p.coords;
+    }
+
+    bool operator>(const BasicPoint &p) const {
+        return coords > p.coords;
+    }
+
+    bool operator<=(const BasicPoint &p) const {
+        return coords <= p.coords;
+    }
+
+    bool operator>=(const BasicPoint &p) const {
+        return coords >= p.coords;
+    }
+
+    bool operator==(const BasicPoint &p) const {
+        return coords == p.coords;
+    }
+
+    bool operator!=(const BasicPoint &p) const {
+        return coords != p.coords;
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const BasicPoint &p) {
+        os << "(";
+        for (std::size_t axis = 0; axis < Dim; ++axis) {
+            os << (axis == 0 ? "" : " , ") << p[axis];
+        }
+        os << ")";
+        return os;
+    }
+
+private:
+    std::array<Scalar, Dim> coords;
+};
+
+// Axis-aligned box for the generic kd-tree, Rect in the 2-d double case
+template<std::size_t Dim, class Scalar>
+class BasicRect {
+public:
+    BasicRect() = default;
+
+    BasicRect(const BasicPoint<Dim, Scalar> &low, const BasicPoint<Dim, Scalar> &high) : low(low), high(high) {
+    }
+
+    Scalar lower(std::size_t axis) const {
+        return low[axis];
+    }
+
+    Scalar upper(std::size_t axis) const {
+        return high[axis];
+    }
+
+    double distance(const BasicPoint<Dim, Scalar> &p) const {
+        return std::sqrt(squaredDistance(p));
+    }
+
+    // Squared distance to the point of the box closest to p
+    double squaredDistance(const BasicPoint<Dim, Scalar> &p) const {
+        return sumAxes<Dim>([&](std::size_t axis) {
+            double d = p[axis] < low[axis] ? double(low[axis]) - p[axis]
+                                           : (p[axis] > high[axis] ? double(p[axis]) - high[axis] : 0);
+            return d * d;
+        });
+    }
+
+    bool contains(const BasicPoint<Dim, Scalar> &p) const {
+        return allAxes<Dim>([&](std::size_t axis) {
+            return p[axis] >= low[axis] && p[axis] <= high[axis];
+        });
+    }
+
+    bool contains(const BasicRect &r) const {
+        return allAxes<Dim>([&](std::size_t axis) {
+            return r.lower(axis) >= low[axis] && r.upper(axis) <= high[axis];
+        });
+    }
+
+    bool intersects(const BasicRect &r) const {
+        return allAxes<Dim>([&](std::size_t axis) {
+            return r.lower(axis) <= high[axis] && r.upper(axis) >= low[axis];
+        });
+    }
+
+private:
+    BasicPoint<Dim, Scalar> low;
+    BasicPoint<Dim, Scalar> high;
+};
+
+// Point and rectangle types of a dimension and coordinate type, made from
+// their coordinates. The 2-d double ones are Point and Rect.
+template<std::size_t Dim, class Scalar>
+struct Geometry {
+    using point = BasicPoint<Dim, Scalar>;
+    using rect = BasicRect<Dim, Scalar>;
+
+    static point makePoint(const std::array<Scalar, Dim> &coords) {
+        return point(coords);
     }
 
-    Iterator &operator=(const Point &p) {
-        if (vector.size() < cur) {
-            vector.resize(cur);
+    static rect makeRect(const std::array<Scalar, Dim> &low, const std::array<Scalar, Dim> &high) {
+        return rect(point(low), point(high));
+    }
+};
+
+template<>
+struct Geometry<2, double> {
+    using point = Point;
+    using rect = Rect;
+
+    static point makePoint(const std::array<double, 2> &coords) {
+        return Point(coords[0], coords[1]);
+    }
+
+    static rect makeRect(const std::array<double, 2> &low, const std::array<double, 2> &high) {
+        return Rect(Point(low[0], low[1]), Point(high[0], high[1]));
+    }
+};
+
+// Largest Stored not above v and smallest Stored not below it, for bounds
+// that must stay on their side of v when kept in a smaller type
+template<class Stored, class Scalar>
+Stored roundDown(Scalar v) {
+    using limits = std::numeric_limits<Stored>;
+    if constexpr (std::is_same_v<Stored, Scalar>) {
+        return v;
+    } else if (v > limits::max() && v != limits::infinity()) {
+        return limits::max();
+    } else if (v < limits::lowest()) {
+        return -limits::infinity();
+    } else {
+        auto r = static_cast<Stored>(v);
+        return r > v ? std::nextafter(r, -limits::infinity()) : r;
+    }
+}
+
+template<class Stored, class Scalar>
+Stored roundUp(Scalar v) {
+    return -roundDown<Stored>(-v);
+}
+
+// Tests of a box against a rectangle or a point of another coordinate type,
+// for trees keeping their boxes rounded outwards to a smaller one
+template<std::size_t Dim, class R, class B>
+bool intersectsBox(const R &r, const B &box) {
+    return allAxes<Dim>([&](std::size_t axis) {
+        return r.lower(axis) <= box.upper(axis) && r.upper(axis) >= box.lower(axis);
+    });
+}
+
+template<std::size_t Dim, class R, class B>
+bool containsBox(const R &r, const B &box) {
+    return allAxes<Dim>([&](std::size_t axis) {
+        return box.lower(axis) >= r.lower(axis) && box.upper(axis) <= r.upper(axis);
+    });
+}
+
+template<std::size_t Dim, class B, class P>
+double boxDistance(const B &box, const P &p) {
+    return sumAxes<Dim>([&](std::size_t axis) {
+        double c = p[axis], low = box.lower(axis), high = box.upper(axis);
+        double d = c < low ? low - c : (c > high ? c - high : 0);
+        return d * d;
+    });
+}
+
+// Maps v from [min, max] onto the whole range of 32-bit integers
+inline std::uint32_t quantize(double v, double min, double max) {
+    if (!(max > min) || v <= min) {
+        return 0;
+    }
+    if (v >= max) {
+        return std::numeric_limits<std::uint32_t>::max();
+    }
+    return static_cast<std::uint32_t>((v - min) / (max - min) * std::numeric_limits<std::uint32_t>::max());
+}
+
+// Position on the Z-order curve: the bits of x and y interleaved
+inline std::uint64_t mortonKey(std::uint32_t x, std::uint32_t y) {
+    auto spread = [](std::uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Position on the Hilbert curve filling the 2^32 x 2^32 grid
+inline std::uint64_t hilbertKey(std::uint32_t x, std::uint32_t y) {
+    std::uint64_t d = 0;
+    for (std::uint32_t s = 1u << 31; s > 0; s >>= 1) {
+        std::uint32_t rx = (x & s) ? 1 : 0;
+        std::uint32_t ry = (y & s) ? 1 : 0;
+        d += std::uint64_t(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = ~x;
+                y = ~y;
+            }
+            std::swap(x, y);
         }
-        vector.push_back(p);
+    }
+    return d;
+}
+
+// Iterators only share the buffer they walk over, so copying one or
+// comparing two of them is O(1) whatever the number of points
+template<class P>
+class BasicIterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = P;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const P *;
+    using reference = const P &;
+
+    BasicIterator(std::shared_ptr<const std::vector<P>> buffer, std::size_t c = 0) : vector(std::move(buffer)) {
+        cur = c;
+    }
+
+    // Walks over a buffer with erased points left in it, skipping every i
+    // with dead[i] set. dead may be shorter than the buffer and must live as
+    // long as it, for instance by sharing its owner.
+    BasicIterator(std::shared_ptr<const std::vector<P>> buffer, std::size_t c, const std::vector<char> *dead)
+            : vector(std::move(buffer)), dead(dead) {
+        cur = c;
+        skip();
+    }
+
+    BasicIterator() {
+        cur = 0;
+    }
+
+    BasicIterator(const BasicIterator &it, std::size_t c) : vector(it.vector), dead(it.dead) {
+        cur = c;
+        skip();
+    }
+
+    const P &operator*() const {
+        return (*vector)[cur];
+    }
+
+    const P *operator->() const {
+        return &(*vector)[cur];
+    }
+
+    BasicIterator &operator++() {
+        ++cur;
+        skip();
         return *this;
     }
 
-    Iterator operator++(int) {
+    BasicIterator operator++(int) {
         auto tmp = *this;
         operator++();
         return tmp;
     }
 
-    friend bool operator==(const Iterator &l, const Iterator &r) {
+    friend bool operator==(const BasicIterator &l, const BasicIterator &r) {
         return l.vector == r.vector && l.cur == r.cur;
     }
 
-    friend bool operator!=(const Iterator &l, const Iterator &r) {
+    friend bool operator!=(const BasicIterator &l, const BasicIterator &r) {
         return !(l == r);
     }
 
 private:
-    std::vector<Point> vector;
+    void skip() {
+        if (dead != nullptr) {
+            while (cur < dead->size() && (*dead)[cur]) {
+                ++cur;
+            }
+        }
+    }
+
+    std::shared_ptr<const std::vector<P>> vector;
+    const std::vector<char> *dead = nullptr;
     std::size_t cur;
 };
 
+using Iterator = BasicIterator<Point>;
+
+// Hands the points over to a buffer shared by both ends of the range
+template<class P>
+std::pair<BasicIterator<P>, BasicIterator<P>> makeRange(std::vector<P> points) {
+    std::size_t count = points.size();
+    auto buffer = std::make_shared<const std::vector<P>>(std::move(points));
+    return std::pair(BasicIterator<P>(buffer, 0), BasicIterator<P>(buffer, count));
+}
+
+// Results of a batch of queries packed one after another: the points
+// found for query i are points[offsets[i]] .. points[offsets[i + 1]]
+template<class P>
+struct BasicBatchResult {
+    std::vector<std::size_t> offsets;
+    std::vector<P> points;
+
+    std::size_t size() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    std::pair<const P *, const P *> operator[](std::size_t i) const {
+        return std::pair(points.data() + offsets[i], points.data() + offsets[i + 1]);
+    }
+};
+
+using BatchResult = BasicBatchResult<Point>;
+
+// Order the queries of a batch are run in. Sorting them along a space-filling
+// curve makes neighbouring queries walk the same parts of a tree.
+enum class BatchOrder {
+    Arrival,
+    Morton,
+    Hilbert
+};
+
+// Splits [0, count) into threads consecutive chunks (0 means one per core)
+// and runs query(i, out) for each i on the shared worker pool, every chunk
+// writing its answers into its own buffer. The buffers are glued together at
+// the end. If order is given the j-th query run is order[j], and the answers
+// are put back in the original order of the queries. An exception thrown by
+// a query comes out of here once the other chunks stopped.
+template<class P = Point, class Query>
+BasicBatchResult<P> runBatch(std::size_t count, std::size_t threads, Query &&query,
+                     const std::vector<std::size_t> &order = {}) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // A chunk is not worth handing to another thread for a handful of queries
+    threads = std::max<std::size_t>(1, std::min(threads, count / 16));
+    std::vector<BasicBatchResult<P>> parts(threads);
+    auto work = [&](std::size_t t) {
+        std::size_t first = count * t / threads;
+        std::size_t last = count * (t + 1) / threads;
+        BasicBatchResult<P> &part = parts[t];
+        part.offsets.reserve(last - first + 1);
+        part.offsets.push_back(0);
+        for (std::size_t i = first; i < last; ++i) {
+            query(order.empty() ? i : order[i], std::back_inserter(part.points));
+            part.offsets.push_back(part.points.size());
+        }
+    };
+    WorkerPool::shared().run(threads, work);
+
+    BasicBatchResult<P> result;
+    std::size_t total = 0;
+    for (const BasicBatchResult<P> &part : parts) {
+        total += part.points.size();
+    }
+    result.offsets.reserve(count + 1);
+    result.offsets.push_back(0);
+    result.points.reserve(total);
+    for (const BasicBatchResult<P> &part : parts) {
+        std::size_t base = result.points.size();
+        for (std::size_t i = 1; i < part.offsets.size(); ++i) {
+            result.offsets.push_back(base + part.offsets[i]);
+        }
+        result.points.insert(result.points.end(), part.points.begin(), part.points.end());
+    }
+    if (order.empty()) {
+        return result;
+    }
+
+    BasicBatchResult<P> scattered;
+    scattered.offsets.assign(count + 1, 0);
+    for (std::size_t j = 0; j < count; ++j) {
+        scattered.offsets[order[j] + 1] = result.offsets[j + 1] - result.offsets[j];
+    }
+    std::partial_sum(scattered.offsets.begin(), scattered.offsets.end(), scattered.offsets.begin());
+    scattered.points.resize(total);
+    for (std::size_t j = 0; j < count; ++j) {
+        std::copy(result.points.begin() + result.offsets[j], result.points.begin() + result.offsets[j + 1],
+                  scattered.points.begin() + scattered.offsets[order[j]]);
+    }
+    return scattered;
+}
+
 namespace rbtree {
 
     class PointSet {
@@ -237,8 +655,9 @@ namespace rbtree {
         void put(const Point &p) {
             if (!contains(p)) {
                 rbmap.insert(p);
-                iterator = p;
-                ++iterator;
+                ownPoints().push_back(p);
+                xs.push_back(p.x());
+                ys.push_back(p.y());
                 ++Size;
             }
         }
@@ -248,66 +667,103 @@ namespace rbtree {
         }
 
         std::pair<ForwardIt, ForwardIt> range(const Rect &r) const {
-            Iterator it = Iterator();
-            for (auto point : rbmap) {
+            std::vector<Point> result;
+            range(r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt range(const Rect &r, OutputIt out) const {
+            for_each_in_range(r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point inside r
+        template<class F>
+        void for_each_in_range(const Rect &r, F &&f) const {
+            for (const Point &point : rbmap) {
                 if (r.contains(point)) {
-                    it = point;
-                    ++it;
+                    f(point);
+                }
+            }
+        }
+
+        // Points at most r away from center
+        std::pair<ForwardIt, ForwardIt> within(const Point &center, double r) const {
+            std::vector<Point> result;
+            within(center, r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt within(const Point &center, double r, OutputIt out) const {
+            for_each_within(center, r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point at most r away from center, scanning only
+        // the band of x the circle spans
+        template<class F>
+        void for_each_within(const Point &center, double r, F &&f) const {
+            if (r < 0) {
+                return;
+            }
+            // The band is widened by an ulp on each side, since rounding its
+            // bounds may cut off points right on the circle
+            double low = std::nextafter(center.x() - r, -std::numeric_limits<double>::infinity());
+            double high = std::nextafter(center.x() + r, std::numeric_limits<double>::infinity());
+            auto first = rbmap.lower_bound(Point(low, std::numeric_limits<double>::lowest()));
+            auto last = rbmap.upper_bound(Point(high, std::numeric_limits<double>::max()));
+            for (auto it = first; it != last; ++it) {
+                if (it->squaredDistance(center) <= r * r) {
+                    f(*it);
                 }
             }
-            return std::pair(Iterator(it, 0), it);
         }
 
         ForwardIt begin() const {
-            return Iterator(iterator, 0);
+            return Iterator(points, 0);
         }
 
         ForwardIt end() const {
-            return Iterator(iterator);
+            return Iterator(points, points->size());
         }
 
         std::optional<Point> nearest(const Point &p) const {
             if (Size == 0) return std::nullopt;
-            Point pmin = *iterator;
-            double min_distance = std::numeric_limits<double>::max();;
-            for (Point point : rbmap) {
-                if (point.distance(p) < min_distance) {
-                    pmin = point;
-                    min_distance = point.distance(p);
-                }
-            }
-            return pmin;
+            double distance;
+            return (*points)[simd::nearestIndex(xs.data(), ys.data(), Size, p.x(), p.y(), distance)];
         }
 
 
         std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const {
-            Iterator it = Iterator();
-            std::vector<bool> vector(Size);
-            auto end = Iterator(iterator);
+            std::vector<Point> result;
+            nearest(p, k, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Writes the k nearest points to out, the closest first
+        template<class OutputIt>
+        OutputIt nearest(const Point &p, std::size_t k, OutputIt out) const {
+            if (k > Size) {
+                k = Size;
+            }
+            std::vector<double> distances(Size);
+            simd::squaredDistances(xs.data(), ys.data(), Size, p.x(), p.y(), distances.data());
+            std::vector<std::size_t> order(Size);
+            std::iota(order.begin(), order.end(), 0);
+            std::partial_sort(order.begin(), order.begin() + k, order.end(), [&](std::size_t a, std::size_t b) {
+                return distances[a] != distances[b] ? distances[a] < distances[b] : a < b;
+            });
             for (std::size_t i = 0; i < k; i++) {
-                double min_distance = std::numeric_limits<double>::max();
-                auto begin = Iterator(iterator, 0);
-                Point pmin = *begin;
-                std::size_t jpmin = 0;
-                for (std::size_t j = 0; j < Size; j++) {
-                    if ((*begin).distance(p) < min_distance && vector[j] == false) {
-                        pmin = *begin;
-                        jpmin = j;
-                        min_distance = (*begin).distance(p);
-                    }
-                    ++begin;
-                }
-                it = pmin;
-                ++it;
-                vector[jpmin] = true;
+                *out++ = (*points)[order[i]];
             }
-            return std::pair(Iterator(it, 0), it);
+            return out;
         }
 
         friend std::ostream &operator<<(std::ostream &os, const PointSet &pointSet) {
             os << "{";
-            auto point = pointSet.begin();
-            while (point != pointSet.end()) {
+            for (auto point = pointSet.begin(); point != pointSet.end(); ++point) {
                 os << *point;
             }
             os << "}";
@@ -315,63 +771,448 @@ namespace rbtree {
         }
 
     private:
+        // Copies the points first if an iterator or a copy of the set still shares them
+        std::vector<Point> &ownPoints() {
+            if (points.use_count() > 1) {
+                points = std::make_shared<std::vector<Point>>(*points);
+            }
+            return *points;
+        }
+
         size_t Size;
         std::set<Point> rbmap;
-        Iterator iterator = Iterator();
+        // Points in the order of insertion, shared with begin() and end()
+        std::shared_ptr<std::vector<Point>> points = std::make_shared<std::vector<Point>>();
+        // Their coordinates again, laid out for the distance kernels
+        std::vector<double> xs;
+        std::vector<double> ys;
     };
 
 }
 
-class Node {
+// Stack for walking trees without recursion. The first N entries live inside
+// the object, so a search of a reasonably balanced tree does not allocate,
+// and deeper ones spill over to the heap instead of the call stack.
+template<class T, std::size_t N = 64>
+class SmallStack {
+public:
+    bool empty() const {
+        return count == 0;
+    }
+
+    void push(const T &item) {
+        if (count < N) {
+            items[count] = item;
+        } else {
+            overflow.push_back(item);
+        }
+        ++count;
+    }
+
+    T pop() {
+        --count;
+        if (count < N) {
+            return items[count];
+        }
+        T item = overflow.back();
+        overflow.pop_back();
+        return item;
+    }
+
+private:
+    T items[N];
+    std::vector<T> overflow;
+    std::size_t count = 0;
+};
+
+// Appends the points from first to last that all doesn't hold yet, in their
+// order and each once, so that a bulk build iterates like putting them one
+// by one would
+template<class P, class InputIt>
+void appendNew(std::vector<P> &all, InputIt first, InputIt last) {
+    std::vector<P> held(all);
+    std::sort(held.begin(), held.end());
+    std::vector<P> added(first, last);
+    std::vector<std::size_t> order(added.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&added](std::size_t a, std::size_t b) {
+        return added[a] < added[b];
+    });
+    std::vector<char> fresh(added.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        const P &p = added[order[i]];
+        fresh[order[i]] = (i == 0 || added[order[i - 1]] < p) && !std::binary_search(held.begin(), held.end(), p);
+    }
+    for (std::size_t i = 0; i < added.size(); ++i) {
+        if (fresh[i]) {
+            all.push_back(added[i]);
+        }
+    }
+}
+
+// A node either splits the space where coordinate mod equals split, for
+// instance by the line x = split (mod == 0) or y = split (mod == 1) in the
+// plane, and has two children, or is a leaf keeping up to capacity points
+// in the slots first .. first + count of its tree
+template<class Scalar>
+class BasicNode {
 public:
-    Node(const Point &p, int m);
+    // Index used for a missing child
+    static constexpr std::uint32_t none = std::numeric_limits<std::uint32_t>::max();
 
-    const Point &getPoint() const;
+    BasicNode(int m, std::uint32_t first, std::uint32_t capacity);
 
-    bool isAlive() const;
+    bool isLeaf() const {
+        return leftNode == none;
+    }
+
+    Scalar getSplit() const {
+        return split;
+    }
+
+    // Whether the point belongs to the left subtree
+    template<class P>
+    bool dependence(const P &point) const {
+        return point[mod] < split;
+    }
+
+    std::uint32_t getLeftNode() const {
+        return leftNode;
+    }
 
-    bool dependence(const Point &point) const;
+    std::uint32_t getRightNode() const {
+        return rightNode;
+    }
 
-    void setAlive(bool live);
+    // Turns a leaf into a node splitting at split
+    void setChildren(Scalar split, std::uint32_t leftNode, std::uint32_t rightNode);
 
-    std::shared_ptr<Node> &getLeftNode();
+    std::uint32_t getFirst() const {
+        return first;
+    }
 
-    std::shared_ptr<Node> &getRightNode();
+    // Points below the node, for a leaf the ones in its slots
+    std::uint32_t getCount() const {
+        return count;
+    }
 
-    void setLeftNode(Node *leftNode);
+    void setCount(std::uint32_t count);
 
-    void setRightNode(Node *rightNode);
+    // Slots in the block of a leaf: the bucket size, or a multiple of it for
+    // points that no split parts
+    std::uint32_t getCapacity() const {
+        return capacity;
+    }
 
 
     int mod;
 private:
-    bool alive = true;
-    Point point;
-    std::shared_ptr<Node> leftNode;
-    std::shared_ptr<Node> rightNode;
+    std::uint32_t capacity;
+    Scalar split = 0;
+    std::uint32_t leftNode = none;
+    std::uint32_t rightNode = none;
+    std::uint32_t first;
+    std::uint32_t count = 0;
 };
 
-class Tree {
+using Node = BasicNode<double>;
+
+// Nodes live in one contiguous pool and refer to each other by index.
+// Every leaf owns a block of bucket size slots in the coordinate arrays,
+// one per axis, so that a leaf is scanned as Dim plain arrays.
+// Every node also has the bounding box of the points below it.
+//
+// Insertions keep the depth logarithmic the scapegoat way: a split leaving a
+// leaf deeper than allowed for the tree's size rebuilds the lowest subtree on
+// its path that is too deep for its own size. Rebuilt subtrees return their
+// nodes and slot blocks to free lists that later leaves take from first.
+//
+// Erasing leaves emptied leaves behind as tombstones, with empty boxes that
+// searches never enter, until as many points were erased as are left and the
+// whole tree is rebuilt.
+//
+// Every slot keeps an id next to its point, given by put and handed back when
+// the point is erased, so that the user of the tree can find the point in
+// its own storage without searching.
+//
+// A Stored type other than Scalar makes the tree compact: slots keep their
+// coordinates rounded to Stored, and the id is the index of the exact point
+// in a vector owned by the user of the tree, who passes it in with
+// setSource. Splits are Stored values too, chosen among the coordinates
+// rounded down so that they part the exact points the same way, and boxes
+// are rounded outwards so that they still hold their points. Points too
+// close for any Stored split to part share a leaf bigger than a bucket.
+template<std::size_t Dim, class Scalar, class Stored = Scalar>
+class BasicTree {
 public:
+    static_assert(Dim >= 2, "a kd-tree needs at least two dimensions");
+
+    // Inside the tree Point and Rect are those of its dimension and coordinate type
+    using Point = typename Geometry<Dim, Scalar>::point;
+    using Rect = typename Geometry<Dim, Scalar>::rect;
+    using Node = BasicNode<Stored>;
+    // Bounding box of a node, Rect unless the tree is compact
+    using Box = typename Geometry<Dim, Stored>::rect;
+
+    static constexpr bool compact = !std::is_same_v<Scalar, Stored>;
+
+    // Depth allowed for n points is about log(n) / -log(balance)
+    static constexpr double balance = 0.7;
+
+    explicit BasicTree(std::size_t bucketSize = 1);
+
+    // For a compact tree id is the index of p in the source
+    void put(const Point &p, std::uint32_t id = 0);
+
+    // Id of the point if it was there
+    std::optional<std::uint32_t> erase(const Point &p);
+
+    // Erases the points inside rect, returning their ids
+    std::vector<std::uint32_t> eraseRange(const Rect &rect);
+
+    // Replaces the tree by a median-split one built from the given points,
+    // which are their own source for a compact tree
+    void build(const std::vector<Point> &points);
+
+    // Where a compact tree finds its exact points, to be set again whenever
+    // the vector moves. It must hold every point put into the tree.
+    void setSource(const std::vector<Point> *points) {
+        source = points;
+    }
+
+    // Changes every id i to moved[i], for instance after the source dropped the erased points
+    void remapIds(const std::vector<std::uint32_t> &moved);
 
-    void put(const Point &p);
+    // Rounding to nearest keeps the order of coordinates, and so does
+    // sending the ones out of the range of Stored to its infinities
+    static Stored encode(Scalar c) {
+        if (std::abs(c) > std::numeric_limits<Stored>::max() && !std::isinf(c)) {
+            return c > 0 ? std::numeric_limits<Stored>::infinity() : -std::numeric_limits<Stored>::infinity();
+        }
+        return static_cast<Stored>(c);
+    }
+
+    std::uint32_t getRoot() const;
+
+    // The accessors used by searches are inline to keep calls out of their loops
+    const Node &getNode(std::uint32_t index) const {
+        return nodes[index];
+    }
+
+    std::size_t getBucketSize() const;
+
+    // Bytes held by the pools, counting their capacity
+    std::size_t getMemoryUsage() const;
+
+    // Empty for a leaf that never had points
+    const Box &getBox(std::uint32_t index) const {
+        return boxes[index];
+    }
+
+    // Coordinates on the axis of all slots, rounded for a compact tree
+    const Stored *getCoords(std::size_t axis) const {
+        return coords[axis].data();
+    }
 
-    std::shared_ptr<Node> getPNode() const;
+    // Always exact
+    Point getPoint(std::uint32_t slot) const {
+        if constexpr (compact) {
+            return (*source)[ids[slot]];
+        } else {
+            std::array<Scalar, Dim> c;
+            for (std::size_t axis = 0; axis < Dim; ++axis) {
+                c[axis] = coords[axis][slot];
+            }
+            return Geometry<Dim, Scalar>::makePoint(c);
+        }
+    }
 
 private:
-    void reallyPut(std::shared_ptr<Node> &node, const Point &p);
+    // A point with its id
+    struct Item {
+        Point point;
+        std::uint32_t id;
+
+        Scalar operator[](std::size_t axis) const {
+            return point[axis];
+        }
+    };
+
+    void splitLeaf(std::uint32_t index, const Item &item);
+
+    std::size_t depthLimit(std::uint32_t count) const;
+
+    void rebalance();
+
+    void rebuild(std::uint32_t index);
+
+    // Takes the points out of the subtree, returning its nodes but the root
+    // and all its slot blocks to the free lists
+    std::vector<Item> release(std::uint32_t index);
+
+    std::uint32_t reallyEraseRange(std::uint32_t index, const Rect &rect, std::vector<std::uint32_t> &erasedIds);
 
-    std::shared_ptr<Node> p_node;
+    void fitLeaf(std::uint32_t index);
+
+    void compactIfSparse();
+
+    std::uint32_t newLeaf(int mod);
+
+    // First of blocks contiguous blocks of bucket size slots
+    std::uint32_t newBlocks(std::uint32_t blocks = 1);
+
+    std::uint32_t newNode(int mod, std::uint32_t first);
+
+    void store(std::uint32_t slot, const Item &item);
+
+    Item itemAt(std::uint32_t slot) const;
+
+    void buildItems(std::vector<Item> items);
+
+    // Builds the points into the subtree at index, preferring to split on the node's axis
+    void reallyBuild(std::uint32_t index, typename std::vector<Item>::iterator first,
+                     typename std::vector<Item>::iterator last);
+
+    std::size_t bucketSize;
+    std::vector<Node> nodes;
+    std::vector<Box> boxes;
+    std::array<std::vector<Stored>, Dim> coords;
+    // Id of the point of each slot
+    std::vector<std::uint32_t> ids;
+    const std::vector<Point> *source = nullptr;
+    std::vector<std::uint32_t> freeNodes;
+    std::vector<std::uint32_t> freeBlocks;
+    // Inner nodes passed by the last put or erase, reused to save allocations
+    std::vector<std::uint32_t> path;
+    // Points erased since the last full build
+    std::size_t erased = 0;
 };
 
+using Tree = BasicTree<2, double>;
+
+// Defined in 2dtree.cpp for these dimensions and coordinate types
+extern template class BasicNode<double>;
+extern template class BasicNode<float>;
+extern template class BasicTree<2, double>;
+extern template class BasicTree<2, float>;
+extern template class BasicTree<3, double>;
+extern template class BasicTree<3, float>;
+extern template class BasicTree<2, double, float>;
+extern template class BasicTree<3, double, float>;
+
 namespace kdtree {
-    class PointSet {
+    // Yields the points of a tree in increasing distance from a query point,
+    // expanding only the nodes needed for the points pulled so far. Nodes and
+    // points wait in one priority queue, nodes keyed by their box distance.
+    // Changing the tree invalidates the iterator.
+    template<std::size_t Dim, class Scalar, class Stored = Scalar>
+    class BasicNeighbourIterator {
     public:
+        using Point = typename Geometry<Dim, Scalar>::point;
+        using Tree = BasicTree<Dim, Scalar, Stored>;
 
-        using ForwardIt = Iterator;
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Point;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Point *;
+        using reference = const Point &;
 
-        PointSet() {
+        // The end of any walk
+        BasicNeighbourIterator() = default;
+
+        BasicNeighbourIterator(const Tree &tree, const Point &query);
+
+        const Point &operator*() const {
+            return current;
+        }
+
+        const Point *operator->() const {
+            return &current;
+        }
+
+        BasicNeighbourIterator &operator++();
+
+        BasicNeighbourIterator operator++(int) {
+            auto tmp = *this;
+            operator++();
+            return tmp;
+        }
+
+        // Only the end compares equal to the end
+        friend bool operator==(const BasicNeighbourIterator &l, const BasicNeighbourIterator &r) {
+            return l.tree == nullptr && r.tree == nullptr;
+        }
+
+        friend bool operator!=(const BasicNeighbourIterator &l, const BasicNeighbourIterator &r) {
+            return !(l == r);
+        }
+
+    private:
+        struct Entry {
+            double distance;
+            std::uint32_t index;
+            // Slot of a point rather than a node
+            bool point;
+        };
+
+        // Heap order putting the closest entry on top, points before nodes at equal distances
+        static bool farther(const Entry &a, const Entry &b);
+
+        void push(const Entry &entry);
+
+        const Tree *tree = nullptr;
+        Point query;
+        Point current;
+        std::vector<Entry> queue;
+    };
+
+    using NeighbourIterator = BasicNeighbourIterator<2, double>;
+
+    extern template class BasicNeighbourIterator<2, double>;
+    extern template class BasicNeighbourIterator<2, float>;
+    extern template class BasicNeighbourIterator<3, double>;
+    extern template class BasicNeighbourIterator<3, float>;
+    extern template class BasicNeighbourIterator<2, double, float>;
+    extern template class BasicNeighbourIterator<3, double, float>;
+
+    // kd-tree over points with Dim coordinates of type Scalar. Storing float
+    // coordinates halves the memory; distances are still computed in double.
+    //
+    // With Stored other than Scalar the set keeps each point at full precision
+    // only in its insertion order vector, and the tree leaves a rounded copy
+    // with the index into it. Searches decide on the rounded coordinates and
+    // look up the exact point only when rounding could change the answer, so
+    // results are the same as with Scalar storage.
+    template<std::size_t Dim, class Scalar, class Stored = Scalar>
+    class BasicPointSet {
+    public:
+        // Inside the set Point and Rect are those of its dimension and coordinate type
+        using Point = typename Geometry<Dim, Scalar>::point;
+        using Rect = typename Geometry<Dim, Scalar>::rect;
+        using Tree = BasicTree<Dim, Scalar, Stored>;
+        using Node = BasicNode<Stored>;
+        using NeighbourIterator = BasicNeighbourIterator<Dim, Scalar, Stored>;
+        using BatchResult = BasicBatchResult<Point>;
+
+        using ForwardIt = BasicIterator<Point>;
+
+        // One point per leaf gives the plain kd-tree. A compact set takes
+        // buckets by default, since per point its nodes would outweigh the
+        // coordinates it saves.
+        static constexpr std::size_t defaultBucketSize = Tree::compact ? 16 : 1;
+
+        BasicPointSet() : BasicPointSet(defaultBucketSize) {
+        }
+
+        // Leaves keep up to bucketSize points and are scanned linearly
+        explicit BasicPointSet(std::size_t bucketSize) : tree(bucketSize) {
             Size = 0;
+            tree.setSource(&inserted->points);
+        }
+
+        template<class InputIt>
+        BasicPointSet(InputIt first, InputIt last, std::size_t bucketSize = defaultBucketSize) : BasicPointSet(bucketSize) {
+            build(first, last);
         }
 
         bool empty() const {
@@ -382,75 +1223,265 @@ namespace kdtree {
             return Size;
         }
 
+        // Bytes held by the tree and the insertion order vector, including
+        // their spare capacity
+        std::size_t memory_usage() const {
+            return tree.getMemoryUsage() + inserted->points.capacity() * sizeof(Point) + inserted->dead.capacity();
+        }
+
         void put(const Point &p) {
             if (!contains(p)) {
-                if (p.x() < Xmin)Xmin = p.x();
-                if (p.x() > Xmax)Xmax = p.x();
-                if (p.y() < Ymin)Ymin = p.y();
-                if (p.y() > Ymax)Ymax = p.y();
-                tree.put(p);
-                iterator = p;
-                ++iterator;
+                expand(p);
+                // The tree gives the index back when the point is erased, and
+                // a compact tree reads the point from there
+                Insertions &all = ownPoints();
+                all.points.push_back(p);
+                if (!all.dead.empty()) {
+                    all.dead.push_back(0);
+                }
+                tree.put(p, static_cast<std::uint32_t>(all.points.size() - 1));
                 Size++;
             }
         }
 
+        // Removes the point, returning whether it was there. Amortized O(1)
+        // on top of finding the point in the tree.
+        bool erase(const Point &p) {
+            std::optional<std::uint32_t> id = tree.erase(p);
+            if (!id) {
+                return false;
+            }
+            bury(*id);
+            Size--;
+            dropHolesIfSparse();
+            return true;
+        }
+
+        // Removes the points inside rect, returning how many there were
+        std::size_t erase_range(const Rect &rect) {
+            std::vector<std::uint32_t> ids = tree.eraseRange(rect);
+            for (std::uint32_t id : ids) {
+                bury(id);
+            }
+            Size -= ids.size();
+            dropHolesIfSparse();
+            return ids.size();
+        }
+
+        // Adds the points and rebuilds the whole tree splitting by medians,
+        // so the depth is O(logN) whatever order the points come in.
+        // Iteration keeps the order they came in.
+        template<class InputIt>
+        void build(InputIt first, InputIt last) {
+            std::vector<Point> all(begin(), end());
+            appendNew(all, first, last);
+            for (const Point &p : all) {
+                expand(p);
+            }
+            Size = all.size();
+            inserted = std::make_shared<Insertions>();
+            inserted->points = std::move(all);
+            holes = 0;
+            tree.setSource(&inserted->points);
+            tree.build(inserted->points);
+        }
+
         bool contains(const Point &p) const {
             if (Size == 0) return false;
-            return utilityForContains(tree.getPNode(), p);
+            return utilityForContains(tree.getRoot(), p);
         }
 
         std::pair<ForwardIt, ForwardIt> range(const Rect &rect) const {
-            Iterator it = Iterator();
-            std::shared_ptr<Node> node = tree.getPNode();
-            std::optional<Rect> r = rect;
-            utilityForRange(r, it, node);
-            return std::pair(Iterator(it, 0), it);
+            std::vector<Point> result;
+            range(rect, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt range(const Rect &rect, OutputIt out) const {
+            for_each_in_range(rect, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point inside rect
+        template<class F>
+        void for_each_in_range(const Rect &rect, F &&f) const {
+            if (Size != 0) {
+                utilityForRange(rect, f, tree.getRoot());
+            }
+        }
+
+        // Points at most r away from center
+        std::pair<ForwardIt, ForwardIt> within(const Point &center, double r) const {
+            std::vector<Point> result;
+            within(center, r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt within(const Point &center, double r, OutputIt out) const {
+            for_each_within(center, r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point at most r away from center
+        template<class F>
+        void for_each_within(const Point &center, double r, F &&f) const {
+            if (Size != 0 && r >= 0) {
+                utilityForWithin(center, r * r, f, tree.getRoot());
+            }
+        }
+
+        // Number of points inside rect. Subtrees with their box inside the
+        // query add their point count without being visited.
+        std::size_t count(const Rect &rect) const {
+            if (Size == 0) {
+                return 0;
+            }
+            std::size_t result = 0;
+            SmallStack<std::uint32_t> stack;
+            stack.push(tree.getRoot());
+            while (!stack.empty()) {
+                std::uint32_t index = stack.pop();
+                const Node &node = tree.getNode(index);
+                const auto &box = tree.getBox(index);
+                if (!intersectsBox<Dim>(rect, box)) {
+                    continue;
+                }
+                if (containsBox<Dim>(rect, box)) {
+                    result += node.getCount();
+                } else if (!node.isLeaf()) {
+                    stack.push(node.getRightNode());
+                    stack.push(node.getLeftNode());
+                } else {
+                    for (std::uint32_t i = node.getFirst(); i < node.getFirst() + node.getCount(); ++i) {
+                        result += inside(i, rect);
+                    }
+                }
+            }
+            return result;
         }
 
+        // Iterators share the points with the set, which keeps the erased
+        // ones as holes for them to skip
         ForwardIt begin() const {
-            return Iterator(iterator, 0);
+            return ForwardIt(std::shared_ptr<const std::vector<Point>>(inserted, &inserted->points), 0,
+                             &inserted->dead);
         }
 
         ForwardIt end() const {
-            return Iterator(iterator);
+            return ForwardIt(std::shared_ptr<const std::vector<Point>>(inserted, &inserted->points),
+                             inserted->points.size(), &inserted->dead);
         }
 
         std::optional<Point> nearest(const Point &p) const {
             if (Size == 0) return std::nullopt;
-            std::stack<std::shared_ptr<Node>> stack;
-            stack.push(std::make_shared<Node>(p, 0));
-            double minDistance = std::numeric_limits<double>::max();
-            utilityForNearest(Rect(Point(Xmin, Ymin), Point(Xmax, Ymax)), tree.getPNode(), stack, p, minDistance);
-            stack.top()->setAlive(true);
-            return stack.top()->getPoint();
+            std::vector<Candidate> heap;
+            heap.reserve(1);
+            utilityForNearest(tree.getRoot(), p, 1, heap);
+            return tree.getPoint(heap.front().second);
         }
 
         std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const {
+            std::vector<Point> result;
+            nearest(p, k, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Writes the k nearest points to out, the closest first
+        template<class OutputIt>
+        OutputIt nearest(const Point &p, std::size_t k, OutputIt out) const {
             if (k > Size) {
                 k = Size;
             }
-            Iterator it = Iterator();
-            std::stack<std::shared_ptr<Node>> stack;
-            for (std::size_t i = 0; i < k; i++) {
-                stack.push(std::make_shared<Node>(p, 0));
-                double minDistance = std::numeric_limits<double>::max();
-                utilityForNearest(Rect(Point(Xmin, Ymin),
-                                       Point(Xmax, Ymax)), tree.getPNode(), stack, p, minDistance);
-                it = (stack.top()->getPoint());
-                ++it;
+            if (k == 0) {
+                return out;
             }
-            while (!stack.empty()) {
-                stack.top()->setAlive(true);
-                stack.pop();
+            std::vector<Candidate> heap;
+            heap.reserve(k);
+            utilityForNearest(tree.getRoot(), p, k, heap);
+            std::sort_heap(heap.begin(), heap.end());
+            for (const Candidate &c : heap) {
+                *out++ = tree.getPoint(c.second);
             }
-            return std::pair(Iterator(it, 0), it);
+            return out;
         }
 
-        friend std::ostream &operator<<(std::ostream &os, const PointSet &pointSet) {
+        // All points from the closest one outwards, found only as they are pulled
+        std::pair<NeighbourIterator, NeighbourIterator> neighbours(const Point &p) const {
+            if (Size == 0) {
+                return std::pair(NeighbourIterator(), NeighbourIterator());
+            }
+            return std::pair(NeighbourIterator(tree, p), NeighbourIterator());
+        }
+
+        // k points each at most 1 + eps times as far as the true neighbour of
+        // the same rank, the closest first
+        std::pair<ForwardIt, ForwardIt> nearest_approx(const Point &p, std::size_t k, double eps) const {
+            std::vector<Point> result;
+            nearest_approx(p, k, eps, std::numeric_limits<std::size_t>::max(), std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Stops after visiting maxNodes nodes, with the best points found by
+        // then; these may be fewer than k
+        std::pair<ForwardIt, ForwardIt> nearest_approx(const Point &p, std::size_t k, double eps,
+                                                       std::size_t maxNodes) const {
+            std::vector<Point> result;
+            nearest_approx(p, k, eps, maxNodes, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt nearest_approx(const Point &p, std::size_t k, double eps, std::size_t maxNodes,
+                                OutputIt out) const {
+            if (k > Size) {
+                k = Size;
+            }
+            if (k == 0) {
+                return out;
+            }
+            std::vector<Candidate> heap;
+            heap.reserve(k);
+            double shrink = 1 / ((1 + std::max(eps, 0.)) * (1 + std::max(eps, 0.)));
+            utilityForNearest(tree.getRoot(), p, k, heap, shrink, maxNodes);
+            std::sort_heap(heap.begin(), heap.end());
+            for (const Candidate &c : heap) {
+                *out++ = tree.getPoint(c.second);
+            }
+            return out;
+        }
+
+        // k nearest points for every query, the closest first
+        BatchResult nearest_batch(const std::vector<Point> &queries, std::size_t k, std::size_t threads = 0,
+                                  BatchOrder order = BatchOrder::Arrival) const {
+            return runBatch<Point>(queries.size(), threads, [&](std::size_t i, auto out) {
+                nearest(queries[i], k, out);
+            }, batchOrder(queries, order));
+        }
+
+        // Points inside every rectangle
+        BatchResult range_batch(const std::vector<Rect> &rects, std::size_t threads = 0,
+                                BatchOrder order = BatchOrder::Arrival) const {
+            std::vector<Point> centers;
+            if (order != BatchOrder::Arrival) {
+                centers.reserve(rects.size());
+                for (const Rect &r : rects) {
+                    std::array<Scalar, Dim> center;
+                    for (std::size_t axis = 0; axis < Dim; ++axis) {
+                        center[axis] = (r.lower(axis) + r.upper(axis)) / 2;
+                    }
+                    centers.push_back(Geometry<Dim, Scalar>::makePoint(center));
+                }
+            }
+            return runBatch<Point>(rects.size(), threads, [&](std::size_t i, auto out) {
+                range(rects[i], out);
+            }, batchOrder(centers, order));
+        }
+
+        friend std::ostream &operator<<(std::ostream &os, const BasicPointSet &pointSet) {
             os << "{";
-            auto point = pointSet.begin();
-            while (point != pointSet.end()) {
+            for (auto point = pointSet.begin(); point != pointSet.end(); ++point) {
                 os << *point;
             }
             os << "}";
@@ -458,76 +1489,342 @@ namespace kdtree {
         }
 
     private:
-        bool utilityForContains(std::shared_ptr<Node> node, const Point &p) const {
-            if (node->getPoint() == p) { return true; }
-            if (node->dependence(p)) {
-                if (node->getLeftNode()) {
-                    return utilityForContains(node->getLeftNode(), p);
-                } else {
-                    return false;
+        // Points in the order of insertion. Erasing one only sets its flag in
+        // dead, which stays empty while nothing is erased.
+        struct Insertions {
+            std::vector<Point> points;
+            std::vector<char> dead;
+        };
+
+        // Copies the points first if an iterator or a copy of the set still shares them
+        Insertions &ownPoints() {
+            if (inserted.use_count() > 1) {
+                inserted = std::make_shared<Insertions>(*inserted);
+                tree.setSource(&inserted->points);
+            }
+            return *inserted;
+        }
+
+        // Leaves a hole for iterators to skip where the point at id was
+        void bury(std::uint32_t id) {
+            Insertions &all = ownPoints();
+            if (all.dead.empty()) {
+                all.dead.resize(all.points.size());
+            }
+            all.dead[id] = 1;
+            ++holes;
+        }
+
+        // Closes the holes once there are more of them than points, at the
+        // same rate as the tree rebuilds, so erasing stays amortized O(1)
+        void dropHolesIfSparse() {
+            if (holes <= Size) {
+                return;
+            }
+            Insertions &all = ownPoints();
+            std::vector<std::uint32_t> moved(all.points.size());
+            std::uint32_t kept = 0;
+            for (std::size_t i = 0; i < all.points.size(); ++i) {
+                moved[i] = kept;
+                if (!all.dead[i]) {
+                    all.points[kept++] = all.points[i];
                 }
+            }
+            all.points.resize(kept);
+            all.dead.clear();
+            holes = 0;
+            tree.remapIds(moved);
+        }
+
+        // Permutation sorting the queries along the curve, in the frame of the
+        // set. The curves run over the first two axes.
+        std::vector<std::size_t> batchOrder(const std::vector<Point> &queries, BatchOrder order) const {
+            if (order == BatchOrder::Arrival || Size == 0) {
+                return {};
+            }
+            std::vector<std::pair<std::uint64_t, std::size_t>> keys(queries.size());
+            for (std::size_t i = 0; i < queries.size(); ++i) {
+                std::uint32_t x = quantize(queries[i][0], lower[0], upper[0]);
+                std::uint32_t y = quantize(queries[i][1], lower[1], upper[1]);
+                keys[i] = std::pair(order == BatchOrder::Morton ? mortonKey(x, y) : hilbertKey(x, y), i);
+            }
+            std::sort(keys.begin(), keys.end());
+            std::vector<std::size_t> result(queries.size());
+            for (std::size_t j = 0; j < keys.size(); ++j) {
+                result[j] = keys[j].second;
+            }
+            return result;
+        }
+
+        void expand(const Point &p) {
+            for (std::size_t axis = 0; axis < Dim; ++axis) {
+                lower[axis] = std::min<double>(lower[axis], p[axis]);
+                upper[axis] = std::max<double>(upper[axis], p[axis]);
+            }
+        }
+
+        // Squared distance from p to the point in the slot
+        double slotDistance(std::uint32_t slot, const Point &p) const {
+            return sumAxes<Dim>([&](std::size_t axis) {
+                double d = double(tree.getCoords(axis)[slot]) - double(p[axis]);
+                return d * d;
+            });
+        }
+
+        // Bound on the distance between the rounded point of the slot and the exact one
+        double roundingError(std::uint32_t slot) const {
+            return sumAxes<Dim>([&](std::size_t axis) {
+                return std::abs(double(tree.getCoords(axis)[slot])) * std::numeric_limits<Stored>::epsilon() +
+                       std::numeric_limits<Stored>::denorm_min();
+            });
+        }
+
+        bool inside(std::uint32_t slot, const Rect &rect) const {
+            if constexpr (Tree::compact) {
+                // A rounded coordinate strictly between the rounded bounds has the
+                // exact one inside too, as rounding keeps the order
+                bool tie = false;
+                bool in = allAxes<Dim>([&](std::size_t axis) {
+                    Stored c = tree.getCoords(axis)[slot];
+                    Stored low = Tree::encode(rect.lower(axis)), high = Tree::encode(rect.upper(axis));
+                    tie = tie || c == low || c == high;
+                    return c >= low && c <= high;
+                });
+                return in && (!tie || rect.contains(tree.getPoint(slot)));
             } else {
-                if (node->getRightNode()) {
-                    return utilityForContains(node->getRightNode(), p);
-                } else {
+                return allAxes<Dim>([&](std::size_t axis) {
+                    Scalar c = tree.getCoords(axis)[slot];
+                    return c >= rect.lower(axis) && c <= rect.upper(axis);
+                });
+            }
+        }
+
+        bool near(std::uint32_t slot, const Point &center, double squaredRadius) const {
+            if constexpr (Tree::compact) {
+                double distance = std::sqrt(slotDistance(slot, center)), error = roundingError(slot);
+                double radius = std::sqrt(squaredRadius);
+                if (distance - error > radius) {
                     return false;
                 }
+                return distance + error <= radius || tree.getPoint(slot).squaredDistance(center) <= squaredRadius;
+            } else {
+                return slotDistance(slot, center) <= squaredRadius;
             }
         }
 
-        void utilityForNearest(Rect rect, std::shared_ptr<Node> node, std::stack<std::shared_ptr<Node>> &stack,
-                               const Point &p, double &minDistance) const {
-            if (node->isAlive() && node->getPoint().distance(p) < minDistance) {
-                minDistance = node->getPoint().distance(p);
-                std::shared_ptr<Node> n = stack.top();
-                stack.pop();
-                n->setAlive(true);
-                node->setAlive(false);
-                stack.push(node);
-            }
-            std::pair<std::optional<Rect>, std::optional<Rect>> pair;
-            if (node->mod == 0) {
-                pair = rect.splitX(node->getPoint().x());
+        bool matches(std::uint32_t slot, const Point &p) const {
+            bool rounded = allAxes<Dim>([&](std::size_t axis) {
+                return tree.getCoords(axis)[slot] == Tree::encode(p[axis]);
+            });
+            if constexpr (Tree::compact) {
+                return rounded && tree.getPoint(slot) == p;
             } else {
-                pair = rect.splitY(node->getPoint().y());
+                return rounded;
             }
-            if (pair.first.has_value() && pair.first->distance(p) < minDistance && node->getLeftNode()) {
-                utilityForNearest(pair.first.value(), node->getLeftNode(), stack, p, minDistance);
+        }
+
+        bool utilityForContains(std::uint32_t index, const Point &p) const {
+            while (!tree.getNode(index).isLeaf()) {
+                const Node &node = tree.getNode(index);
+                index = node.dependence(p) ? node.getLeftNode() : node.getRightNode();
             }
-            if (pair.second.has_value() && pair.second->distance(p) < minDistance && node->getRightNode()) {
-                utilityForNearest(pair.second.value(), node->getRightNode(), stack, p, minDistance);
+            const Node &leaf = tree.getNode(index);
+            for (std::uint32_t i = leaf.getFirst(); i < leaf.getFirst() + leaf.getCount(); ++i) {
+                if (matches(i, p)) {
+                    return true;
+                }
             }
+            return false;
         }
 
-        void utilityForRange(std::optional<Rect> &rect, Iterator &it, std::shared_ptr<Node> &node) const {
-            if (!rect.has_value()) {
-                return;
-            }
-            if (rect->contains(node->getPoint())) {
-                it = node->getPoint();
-                ++it;
+        // Squared distance to the query and slot of a point
+        using Candidate = std::pair<double, std::uint32_t>;
+
+        static void offer(std::vector<Candidate> &heap, std::size_t k, double distance, std::uint32_t slot) {
+            if (heap.size() < k) {
+                heap.emplace_back(distance, slot);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (distance < heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = Candidate(distance, slot);
+                std::push_heap(heap.begin(), heap.end());
             }
-            std::pair<std::optional<Rect>, std::optional<Rect>> pair;
-            if (node->mod == 0) {
-                pair = rect->splitX(node->getPoint().x());
+        }
+
+        // Offers the points of a leaf to the heap. Big buckets of 2-d double
+        // points go through the SIMD kernels, for a few points a call costs
+        // more than it saves. Rounded points are only looked up when they
+        // might beat the heap.
+        void scanForNearest(std::uint32_t first, std::uint32_t count, const Point &p, std::size_t k,
+                            std::vector<Candidate> &heap) const {
+            if constexpr (Tree::compact) {
+                for (std::uint32_t i = first; i < first + count; ++i) {
+                    if (heap.size() == k &&
+                        std::sqrt(slotDistance(i, p)) - roundingError(i) > std::sqrt(heap.front().first)) {
+                        continue;
+                    }
+                    offer(heap, k, tree.getPoint(i).squaredDistance(p), i);
+                }
+            } else if constexpr (Dim != 2 || !std::is_same_v<Scalar, double>) {
+                for (std::uint32_t i = first; i < first + count; ++i) {
+                    offer(heap, k, slotDistance(i, p), i);
+                }
             } else {
-                pair = rect->splitY(node->getPoint().y());
+                const double *xs = tree.getCoords(0) + first, *ys = tree.getCoords(1) + first;
+                if (count < 8) {
+                    for (std::uint32_t i = 0; i < count; ++i) {
+                        double dx = xs[i] - p[0], dy = ys[i] - p[1];
+                        offer(heap, k, dx * dx + dy * dy, first + i);
+                    }
+                } else if (k == 1) {
+                    double distance;
+                    std::size_t i = simd::nearestIndex(xs, ys, count, p[0], p[1], distance);
+                    offer(heap, k, distance, first + static_cast<std::uint32_t>(i));
+                } else {
+                    double distances[64];
+                    for (std::uint32_t from = 0; from < count; from += 64) {
+                        std::uint32_t n = std::min<std::uint32_t>(64, count - from);
+                        simd::squaredDistances(xs + from, ys + from, n, p[0], p[1], distances);
+                        for (std::uint32_t i = 0; i < n; ++i) {
+                            offer(heap, k, distances[i], first + from + i);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Collects the k points closest to p in a max-heap in one pass. The tree
+        // is only read, so any number of threads may search it at once.
+        //
+        // Boxes are only entered when closer than the k-th distance so far
+        // times shrink, which is 1 / (1 + eps)^2 for approximate searches, and
+        // the search gives up after entering budget nodes.
+        void utilityForNearest(std::uint32_t root, const Point &p, std::size_t k, std::vector<Candidate> &heap,
+                               double shrink = 1,
+                               std::size_t budget = std::numeric_limits<std::size_t>::max()) const {
+            SmallStack<std::uint32_t> stack;
+            stack.push(root);
+            while (!stack.empty()) {
+                std::uint32_t index = stack.pop();
+                // The heap may have got better since the node was pushed
+                if (heap.size() == k && boxDistance<Dim>(tree.getBox(index), p) >= heap.front().first * shrink) {
+                    continue;
+                }
+                const Node &node = tree.getNode(index);
+                // Erased points may leave empty subtrees behind
+                if (node.getCount() == 0) {
+                    continue;
+                }
+                if (budget-- == 0) {
+                    break;
+                }
+                if (node.isLeaf()) {
+                    scanForNearest(node.getFirst(), node.getCount(), p, k, heap);
+                    continue;
+                }
+                std::uint32_t nearNode = node.getLeftNode(), farNode = node.getRightNode();
+                double nearDistance = boxDistance<Dim>(tree.getBox(nearNode), p);
+                double farDistance = boxDistance<Dim>(tree.getBox(farNode), p);
+                if (farDistance < nearDistance) {
+                    std::swap(nearNode, farNode);
+                    std::swap(nearDistance, farDistance);
+                }
+                // The closer box goes first, so it is pushed last
+                if (heap.size() < k || farDistance < heap.front().first * shrink) {
+                    stack.push(farNode);
+                }
+                if (heap.size() < k || nearDistance < heap.front().first * shrink) {
+                    stack.push(nearNode);
+                }
             }
+        }
+
+        // Node still to visit and whether its box lies inside the query
+        struct Frame {
+            std::uint32_t index;
+            bool inside;
+        };
 
-            if (node->getLeftNode()) {
-                utilityForRange(pair.first, it, node->getLeftNode());
+        template<class F>
+        void utilityForRange(const Rect &rect, F &f, std::uint32_t root) const {
+            SmallStack<Frame> stack;
+            stack.push(Frame{root, false});
+            while (!stack.empty()) {
+                Frame frame = stack.pop();
+                const Node &node = tree.getNode(frame.index);
+                if (!frame.inside) {
+                    const auto &box = tree.getBox(frame.index);
+                    if (!intersectsBox<Dim>(rect, box)) {
+                        continue;
+                    }
+                    // Below a box inside the query every point matches
+                    frame.inside = containsBox<Dim>(rect, box);
+                }
+                if (!node.isLeaf()) {
+                    stack.push(Frame{node.getRightNode(), frame.inside});
+                    stack.push(Frame{node.getLeftNode(), frame.inside});
+                } else {
+                    for (std::uint32_t i = node.getFirst(); i < node.getFirst() + node.getCount(); ++i) {
+                        if (frame.inside || inside(i, rect)) {
+                            f(tree.getPoint(i));
+                        }
+                    }
+                }
             }
-            if (node->getRightNode()) {
-                utilityForRange(pair.second, it, node->getRightNode());
+        }
+
+        // Same pruning as utilityForNearest with the radius as a fixed bound
+        template<class F>
+        void utilityForWithin(const Point &center, double squaredRadius, F &f, std::uint32_t root) const {
+            SmallStack<Frame> stack;
+            stack.push(Frame{root, false});
+            while (!stack.empty()) {
+                Frame frame = stack.pop();
+                const Node &node = tree.getNode(frame.index);
+                if (!frame.inside) {
+                    const auto &box = tree.getBox(frame.index);
+                    if (node.getCount() == 0 || boxDistance<Dim>(box, center) > squaredRadius) {
+                        continue;
+                    }
+                    // Below a box with its farthest corner in the circle every point matches
+                    frame.inside = sumAxes<Dim>([&](std::size_t axis) {
+                        double d = std::max(double(center[axis]) - box.lower(axis),
+                                            double(box.upper(axis)) - center[axis]);
+                        return d * d;
+                    }) <= squaredRadius;
+                }
+                if (!node.isLeaf()) {
+                    stack.push(Frame{node.getRightNode(), frame.inside});
+                    stack.push(Frame{node.getLeftNode(), frame.inside});
+                    continue;
+                }
+                for (std::uint32_t i = node.getFirst(); i < node.getFirst() + node.getCount(); ++i) {
+                    if (frame.inside || near(i, center, squaredRadius)) {
+                        f(tree.getPoint(i));
+                    }
+                }
             }
         }
 
         size_t Size;
         Tree tree;
-        Iterator iterator = Iterator();
-        double Xmin = std::numeric_limits<double>::max();
-        double Ymin = std::numeric_limits<double>::max();
-        double Xmax = std::numeric_limits<double>::min();
-        double Ymax = std::numeric_limits<double>::min();
+        // Shared with begin() and end()
+        std::shared_ptr<Insertions> inserted = std::make_shared<Insertions>();
+        // Erased points still in inserted
+        std::size_t holes = 0;
+        // Bounds of all points ever put, per axis
+        std::array<double, Dim> lower = filled(std::numeric_limits<double>::max());
+        std::array<double, Dim> upper = filled(std::numeric_limits<double>::lowest());
+
+        static std::array<double, Dim> filled(double value) {
+            std::array<double, Dim> result;
+            result.fill(value);
+            return result;
+        }
     };
+
+    using PointSet = BasicPointSet<2, double>;
+
+    // Same results as PointSet with the leaves storing float coordinates
+    using CompactPointSet = BasicPointSet<2, double, float>;
 }
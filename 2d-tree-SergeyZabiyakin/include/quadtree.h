@@ -0,0 +1,239 @@
+#pragma once
+
+#include "primitives.h"
+
+namespace quadtree {
+
+    // Point-region quadtree: every node covers a square, and an inner node
+    // splits it into four equal quadrants whatever the points are, so cells
+    // shrink where the points crowd. A leaf keeps up to bucketSize points and
+    // splits once one more comes.
+    //
+    // Nodes live in one pool, the four children of a node side by side, and
+    // leaves keep their points in blocks of one shared slot pool. Squares are
+    // not stored but halved on the way down from the root square, which
+    // doubles towards points put outside it. Points too far apart for a
+    // finite square to hold all share one leaf, searched linearly. Points at
+    // infinity are rejected.
+    class PointSet {
+    public:
+
+        using ForwardIt = Iterator;
+
+        explicit PointSet(std::size_t bucketSize = 8) : bucketSize(std::max<std::size_t>(bucketSize, 1)) {}
+
+        template<class InputIt>
+        PointSet(InputIt first, InputIt last, std::size_t bucketSize = 8) : PointSet(bucketSize) {
+            for (; first != last; ++first) {
+                put(*first);
+            }
+        }
+
+        bool empty() const {
+            return points->empty();
+        }
+
+        std::size_t size() const {
+            return points->size();
+        }
+
+        void put(const Point &p);
+
+        bool contains(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> range(const Rect &r) const {
+            std::vector<Point> result;
+            range(r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt range(const Rect &r, OutputIt out) const {
+            for_each_in_range(r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point inside r
+        template<class F>
+        void for_each_in_range(const Rect &r, F &&f) const {
+            if (nodes.empty()) {
+                return;
+            }
+            SmallStack<Frame> stack;
+            stack.push(Frame{0, root});
+            while (!stack.empty()) {
+                Frame frame = stack.pop();
+                const Square &s = frame.square;
+                if (s.x > r.xmax() || s.x + s.size < r.xmin() || s.y > r.ymax() || s.y + s.size < r.ymin()) {
+                    continue;
+                }
+                const Node &node = nodes[frame.index];
+                if (node.children != none) {
+                    for (std::uint32_t q = 0; q < 4; ++q) {
+                        stack.push(Frame{node.children + q, quadrant(s, q)});
+                    }
+                    continue;
+                }
+                for (std::uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    if (r.contains(slots[i])) {
+                        f(slots[i]);
+                    }
+                }
+            }
+        }
+
+        // Points at most r away from center
+        std::pair<ForwardIt, ForwardIt> within(const Point &center, double r) const {
+            std::vector<Point> result;
+            within(center, r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt within(const Point &center, double r, OutputIt out) const {
+            for_each_within(center, r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point at most r away from center
+        template<class F>
+        void for_each_within(const Point &center, double r, F &&f) const {
+            if (nodes.empty() || r < 0) {
+                return;
+            }
+            SmallStack<Frame> stack;
+            stack.push(Frame{0, root});
+            while (!stack.empty()) {
+                Frame frame = stack.pop();
+                if (squaredDistance(frame.square, center) > r * r) {
+                    continue;
+                }
+                const Node &node = nodes[frame.index];
+                if (node.children != none) {
+                    for (std::uint32_t q = 0; q < 4; ++q) {
+                        stack.push(Frame{node.children + q, quadrant(frame.square, q)});
+                    }
+                    continue;
+                }
+                for (std::uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    if (slots[i].squaredDistance(center) <= r * r) {
+                        f(slots[i]);
+                    }
+                }
+            }
+        }
+
+        ForwardIt begin() const {
+            return Iterator(points, 0);
+        }
+
+        ForwardIt end() const {
+            return Iterator(points, points->size());
+        }
+
+        std::optional<Point> nearest(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const {
+            std::vector<Point> result;
+            nearest(p, k, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Writes the k nearest points to out, the closest first
+        template<class OutputIt>
+        OutputIt nearest(const Point &p, std::size_t k, OutputIt out) const {
+            for (const Point &point : nearestPoints(p, k)) {
+                *out++ = point;
+            }
+            return out;
+        }
+
+        friend std::ostream &operator<<(std::ostream &os, const PointSet &pointSet) {
+            os << "{";
+            for (auto point = pointSet.begin(); point != pointSet.end(); ++point) {
+                os << *point;
+            }
+            os << "}";
+            return os;
+        }
+
+    private:
+        static constexpr std::uint32_t none = std::numeric_limits<std::uint32_t>::max();
+
+        struct Node {
+            // First of the four children, in the order of quadrant(), or none for a leaf
+            std::uint32_t children = none;
+            // Block of a leaf in the slot pool, none until it gets a point
+            std::uint32_t first = none;
+            std::uint32_t count = 0;
+            std::uint32_t capacity = 0;
+        };
+
+        // Lower left corner and side. A square holds its lower and left edges
+        // but not its upper and right ones, which belong to the next squares.
+        struct Square {
+            double x;
+            double y;
+            double size;
+        };
+
+        struct Frame {
+            std::uint32_t index;
+            Square square;
+        };
+
+        // Quadrants 0 and 1 are the lower ones, 0 and 2 the left ones
+        static Square quadrant(const Square &s, std::uint32_t q) {
+            double half = s.size / 2;
+            return Square{q & 1 ? s.x + half : s.x, q & 2 ? s.y + half : s.y, half};
+        }
+
+        // Quadrant of the square that p falls into, points on the middle lines going up and right
+        static std::uint32_t quadrantOf(const Square &s, const Point &p) {
+            double half = s.size / 2;
+            return (p.x() >= s.x + half ? 1 : 0) | (p.y() >= s.y + half ? 2 : 0);
+        }
+
+        static double squaredDistance(const Square &s, const Point &p) {
+            double dx = std::max({s.x - p.x(), 0., p.x() - (s.x + s.size)});
+            double dy = std::max({s.y - p.y(), 0., p.y() - (s.y + s.size)});
+            return dx * dx + dy * dy;
+        }
+
+        bool covers(const Point &p) const {
+            return p.x() >= root.x && p.x() < root.x + root.size && p.y() >= root.y && p.y() < root.y + root.size;
+        }
+
+        // Doubles the root square towards p until it covers p, or until it
+        // can't double any more and has to cover everything
+        void grow(const Point &p);
+
+        // Makes the root a leaf with every point, its square the whole plane
+        void cover();
+
+        void store(std::uint32_t index, const Point &p);
+
+        void split(std::uint32_t index, const Square &s);
+
+        std::uint32_t newChildren();
+
+        std::vector<Point> nearestPoints(const Point &p, std::size_t k) const;
+
+        // Copies the points first if an iterator or a copy of the set still shares them
+        std::vector<Point> &ownPoints() {
+            if (points.use_count() > 1) {
+                points = std::make_shared<std::vector<Point>>(*points);
+            }
+            return *points;
+        }
+
+        std::size_t bucketSize;
+        // Node 0 is the root
+        std::vector<Node> nodes;
+        std::vector<Point> slots;
+        Square root{0, 0, 0};
+        // Points in the order of insertion, shared with begin() and end()
+        std::shared_ptr<std::vector<Point>> points = std::make_shared<std::vector<Point>>();
+    };
+
+}
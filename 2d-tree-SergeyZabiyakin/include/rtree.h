@@ -0,0 +1,158 @@
+#pragma once
+
+#include "primitives.h"
+
+namespace rtree {
+
+    // Frozen R-tree over rectangles, packed Sort-Tile-Recursive: the
+    // rectangles are sorted by the x of their centres, cut into vertical
+    // slices, and every slice sorted by y and cut into leaves of fanout
+    // rectangles. The leaves are packed the same way into the next level,
+    // and so on up to the root.
+    //
+    // All nodes live in one array, level after level from the leaves up, and
+    // a node's children are a run of the level below it, or of the rectangles
+    // for a leaf. Equal rectangles are all kept.
+    class RectSet {
+    public:
+
+        using ForwardIt = BasicIterator<Rect>;
+
+        static constexpr std::size_t fanout = 16;
+
+        RectSet() = default;
+
+        explicit RectSet(std::vector<Rect> rects);
+
+        template<class InputIt>
+        RectSet(InputIt first, InputIt last) : RectSet(std::vector<Rect>(first, last)) {}
+
+        bool empty() const {
+            return rects->empty();
+        }
+
+        std::size_t size() const {
+            return rects->size();
+        }
+
+        // In the packed order
+        ForwardIt begin() const {
+            return ForwardIt(rects, 0);
+        }
+
+        ForwardIt end() const {
+            return ForwardIt(rects, rects->size());
+        }
+
+        // Rectangles sharing at least a point with r
+        std::pair<ForwardIt, ForwardIt> intersecting(const Rect &r) const {
+            std::vector<Rect> result;
+            intersecting(r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt intersecting(const Rect &r, OutputIt out) const {
+            for_each_intersecting(r, [&out](const Rect &rect) { *out++ = rect; });
+            return out;
+        }
+
+        template<class F>
+        void for_each_intersecting(const Rect &r, F &&f) const {
+            walk([&r](const Rect &box) { return box.intersects(r); }, f);
+        }
+
+        // Rectangles with p inside or on their border
+        std::pair<ForwardIt, ForwardIt> containing(const Point &p) const {
+            std::vector<Rect> result;
+            containing(p, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt containing(const Point &p, OutputIt out) const {
+            for_each_containing(p, [&out](const Rect &rect) { *out++ = rect; });
+            return out;
+        }
+
+        template<class F>
+        void for_each_containing(const Point &p, F &&f) const {
+            walk([&p](const Rect &box) { return box.contains(p); }, f);
+        }
+
+        // Closest rectangle to p, one containing p being at distance 0
+        std::optional<Rect> nearest(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const {
+            std::vector<Rect> result;
+            nearest(p, k, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Writes the k nearest rectangles to out, the closest first
+        template<class OutputIt>
+        OutputIt nearest(const Point &p, std::size_t k, OutputIt out) const {
+            for (const Rect &rect : nearestRects(p, k)) {
+                *out++ = rect;
+            }
+            return out;
+        }
+
+        friend std::ostream &operator<<(std::ostream &os, const RectSet &rectSet) {
+            os << "{";
+            for (const Rect &r : *rectSet.rects) {
+                os << r;
+            }
+            os << "}";
+            return os;
+        }
+
+    private:
+        struct Node {
+            Rect box;
+            // Children in the level below, or rectangles for a leaf
+            std::uint32_t first;
+            std::uint32_t count;
+        };
+
+        // Calls f for every rectangle passing test, entering only the nodes
+        // whose box passes it. The test must hold for a box whenever it holds
+        // for something inside it.
+        template<class Test, class F>
+        void walk(Test test, F &f) const {
+            if (nodes.empty()) {
+                return;
+            }
+            SmallStack<std::uint32_t> stack;
+            stack.push(static_cast<std::uint32_t>(nodes.size() - 1));
+            while (!stack.empty()) {
+                std::uint32_t index = stack.pop();
+                const Node &node = nodes[index];
+                if (!test(node.box)) {
+                    continue;
+                }
+                if (index >= leaves) {
+                    for (std::uint32_t i = node.first + node.count; i-- > node.first;) {
+                        stack.push(i);
+                    }
+                    continue;
+                }
+                for (std::uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    if (test((*rects)[i])) {
+                        f((*rects)[i]);
+                    }
+                }
+            }
+        }
+
+        std::vector<Rect> nearestRects(const Point &p, std::size_t k) const;
+
+        // The root is last
+        std::vector<Node> nodes;
+        // Nodes before this index are leaves
+        std::size_t leaves = 0;
+        // Also the buffer begin() and end() walk over, so iterating needs no copy
+        std::shared_ptr<const std::vector<Rect>> rects = std::make_shared<const std::vector<Rect>>();
+    };
+
+}
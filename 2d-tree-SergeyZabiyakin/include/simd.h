@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+
+// Distance kernels over points kept as separate x and y arrays. The widest
+// instruction set the CPU supports (AVX-512, AVX2 or plain scalar code) is
+// picked on the first call.
+namespace simd {
+
+    // out[i] = (xs[i] - px)^2 + (ys[i] - py)^2 for every i < n
+    void squaredDistances(const double *xs, const double *ys, std::size_t n, double px, double py, double *out);
+
+    // Index of the first of the n > 0 points closest to (px, py), its squared
+    // distance is stored to distance
+    std::size_t nearestIndex(const double *xs, const double *ys, std::size_t n, double px, double py,
+                             double &distance);
+
+    // Name of the kernels in use: "avx512", "avx2" or "scalar"
+    const char *kernelName();
+
+    namespace detail {
+
+        struct Kernels {
+            void (*distances)(const double *, const double *, std::size_t, double, double, double *);
+            std::size_t (*nearest)(const double *, const double *, std::size_t, double, double, double &);
+            const char *name;
+        };
+
+        // Kernels of the given name, or null if the build or the CPU can't
+        // run them. Lets tests try every version and not only the one picked.
+        const Kernels *kernelsFor(const char *name);
+
+    }
+
+}
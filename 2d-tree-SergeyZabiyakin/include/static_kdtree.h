@@ -0,0 +1,75 @@
+#pragma once
+
+#include "primitives.h"
+
+namespace kdtree {
+
+    // Frozen 2-d tree built once from a set of points. Nodes are kept in one
+    // array in implicit (Eytzinger) order: the children of node i are 2i + 1
+    // and 2i + 2, and node i splits by x on even depths and by y on odd ones.
+    // The tree is complete, so there is no need to store any links.
+    class StaticPointSet {
+    public:
+
+        using ForwardIt = Iterator;
+
+        StaticPointSet() = default;
+
+        explicit StaticPointSet(std::vector<Point> points);
+
+        template<class InputIt>
+        StaticPointSet(InputIt first, InputIt last) : StaticPointSet(std::vector<Point>(first, last)) {}
+
+        bool empty() const {
+            return nodes->empty();
+        }
+
+        std::size_t size() const {
+            return nodes->size();
+        }
+
+        bool contains(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> range(const Rect &rect) const;
+
+        ForwardIt begin() const {
+            return Iterator(nodes, 0);
+        }
+
+        ForwardIt end() const {
+            return Iterator(nodes, nodes->size());
+        }
+
+        std::optional<Point> nearest(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const;
+
+        friend std::ostream &operator<<(std::ostream &os, const StaticPointSet &pointSet) {
+            os << "{";
+            for (const Point &p : *pointSet.nodes) {
+                os << p;
+            }
+            os << "}";
+            return os;
+        }
+
+    private:
+        // Squared distance to the query and index of a node
+        using Candidate = std::pair<double, std::size_t>;
+
+        void build(std::vector<Point> &tree, std::size_t index, std::vector<Point>::iterator first,
+                   std::vector<Point>::iterator last, int depth);
+
+        bool utilityForContains(std::size_t index, int depth, const Point &p) const;
+
+        void utilityForRange(const Rect &rect, std::size_t index, int depth, std::vector<Point> &result) const;
+
+        void utilityForNearest(const Rect &region, std::size_t index, int depth, const Point &p, std::size_t k,
+                               std::vector<Candidate> &heap) const;
+
+        // Also the buffer begin() and end() walk over, so iterating needs no copy
+        std::shared_ptr<const std::vector<Point>> nodes = std::make_shared<const std::vector<Point>>();
+        Rect box = Rect(Point(), Point());
+    };
+
+}
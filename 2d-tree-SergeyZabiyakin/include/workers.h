@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads started once and kept waiting for work, so that running a batch
+// costs a wake-up rather than a thread start. Any number of threads may run
+// jobs at once, and a task may run a job of its own: the thread calling run
+// always works on its own job too, so a job finishes even if every worker
+// is busy elsewhere.
+class WorkerPool {
+public:
+    explicit WorkerPool(std::size_t workers);
+
+    // Waits for the workers to finish what they run and joins them
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    std::size_t size() const {
+        return threads.size();
+    }
+
+    // Runs task(0) .. task(count - 1) and returns once all of them are done.
+    // If tasks throw, the ones not started yet are skipped and the first
+    // exception is rethrown here after the others finished.
+    void run(std::size_t count, const std::function<void(std::size_t)> &task);
+
+    // One worker per core but the one of the caller, started on first use
+    static WorkerPool &shared();
+
+private:
+    struct Job;
+
+    void work();
+
+    // Runs the next task of the job, returning false if none was left to start
+    bool runNext(const std::shared_ptr<Job> &job, std::unique_lock<std::mutex> &lock);
+
+    void stop();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    // Jobs with tasks not started yet, the oldest first
+    std::deque<std::shared_ptr<Job>> jobs;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
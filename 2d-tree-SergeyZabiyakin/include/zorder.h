@@ -0,0 +1,203 @@
+#pragma once
+
+#include "primitives.h"
+
+#include <cstring>
+
+namespace zorder {
+
+    // Points kept in one array sorted along the Z-order curve, so that points
+    // close in the plane are mostly close in memory. The curve runs over the
+    // bits of the coordinates mapped to unsigned integers in the same order,
+    // which needs no frame and keeps distinct points on distinct codes.
+    //
+    // Range searches scan the array from the code of the lower corner to the
+    // one of the upper corner, jumping over runs outside the rectangle with
+    // BIGMIN. Putting a point is linear in the size; build() adds many at once.
+    class PointSet {
+    public:
+
+        using ForwardIt = Iterator;
+
+        PointSet() = default;
+
+        template<class InputIt>
+        PointSet(InputIt first, InputIt last) {
+            build(first, last);
+        }
+
+        bool empty() const {
+            return cells.empty();
+        }
+
+        std::size_t size() const {
+            return cells.size();
+        }
+
+        void put(const Point &p);
+
+        // Adds the points, sorting the whole array once. Iteration keeps
+        // the order they came in, like after putting them one by one.
+        template<class InputIt>
+        void build(InputIt first, InputIt last) {
+            insertAll(std::vector<Point>(first, last));
+        }
+
+        bool contains(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> range(const Rect &r) const {
+            std::vector<Point> result;
+            range(r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt range(const Rect &r, OutputIt out) const {
+            for_each_in_range(r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point inside r
+        template<class F>
+        void for_each_in_range(const Rect &r, F &&f) const {
+            Code low = code(Point(r.xmin(), r.ymin())), high = code(Point(r.xmax(), r.ymax()));
+            if (low[0] > high[0] || low[1] > high[1]) {
+                return;
+            }
+            std::size_t i = lowerBound(0, low);
+            while (i < cells.size()) {
+                Code c = code(cells[i]);
+                if (less(high, c)) {
+                    return;
+                }
+                if (inside(c, low, high)) {
+                    f(cells[i++]);
+                } else {
+                    i = skip(i, c, low, high);
+                }
+            }
+        }
+
+        // Points at most r away from center
+        std::pair<ForwardIt, ForwardIt> within(const Point &center, double r) const {
+            std::vector<Point> result;
+            within(center, r, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        template<class OutputIt>
+        OutputIt within(const Point &center, double r, OutputIt out) const {
+            for_each_within(center, r, [&out](const Point &point) { *out++ = point; });
+            return out;
+        }
+
+        // Calls f for every point at most r away from center, searching the square around the circle
+        template<class F>
+        void for_each_within(const Point &center, double r, F &&f) const {
+            if (r < 0) {
+                return;
+            }
+            for_each_in_range(around(center, r), [&](const Point &point) {
+                if (point.squaredDistance(center) <= r * r) {
+                    f(point);
+                }
+            });
+        }
+
+        ForwardIt begin() const {
+            return Iterator(points, 0);
+        }
+
+        ForwardIt end() const {
+            return Iterator(points, points->size());
+        }
+
+        std::optional<Point> nearest(const Point &p) const;
+
+        std::pair<ForwardIt, ForwardIt> nearest(const Point &p, std::size_t k) const {
+            std::vector<Point> result;
+            nearest(p, k, std::back_inserter(result));
+            return makeRange(std::move(result));
+        }
+
+        // Writes the k nearest points to out, the closest first
+        template<class OutputIt>
+        OutputIt nearest(const Point &p, std::size_t k, OutputIt out) const {
+            for (const Point &point : nearestPoints(p, k)) {
+                *out++ = point;
+            }
+            return out;
+        }
+
+        friend std::ostream &operator<<(std::ostream &os, const PointSet &pointSet) {
+            os << "{";
+            for (auto point = pointSet.begin(); point != pointSet.end(); ++point) {
+                os << *point;
+            }
+            os << "}";
+            return os;
+        }
+
+    private:
+        // Coordinates mapped to unsigned integers of the same order, x first
+        using Code = std::array<std::uint64_t, 2>;
+
+        static std::uint64_t ordered(double v) {
+            // Both zeros are the same coordinate
+            if (v == 0) {
+                v = 0;
+            }
+            std::uint64_t bits;
+            std::memcpy(&bits, &v, sizeof bits);
+            return bits >> 63 ? ~bits : bits | (std::uint64_t(1) << 63);
+        }
+
+        static Code code(const Point &p) {
+            return Code{ordered(p.x()), ordered(p.y())};
+        }
+
+        // Z-order: the axis with the highest differing bit decides, y on a tie
+        // as its bits come first on the curve
+        static bool less(const Code &a, const Code &b) {
+            std::uint64_t dx = a[0] ^ b[0], dy = a[1] ^ b[1];
+            bool yHigher = !(dy < dx && dy < (dy ^ dx));
+            return yHigher ? a[1] < b[1] : a[0] < b[0];
+        }
+
+        static bool inside(const Code &c, const Code &low, const Code &high) {
+            return c[0] >= low[0] && c[0] <= high[0] && c[1] >= low[1] && c[1] <= high[1];
+        }
+
+        // Smallest code after c on the curve inside the box from low to high
+        static std::optional<Code> bigmin(const Code &c, Code low, Code high);
+
+        // Square around the circle, big enough despite rounding
+        static Rect around(const Point &center, double r);
+
+        // First position from i on with a code not below c
+        std::size_t lowerBound(std::size_t i, const Code &c) const;
+
+        // Position of the next point that may be inside the box after the one at i, outside it
+        std::size_t skip(std::size_t i, const Code &c, const Code &low, const Code &high) const;
+
+        void sortCells();
+
+        void insertAll(std::vector<Point> added);
+
+        std::vector<Point> nearestPoints(const Point &p, std::size_t k) const;
+
+        // Copies the points first if an iterator or a copy of the set still shares them
+        std::vector<Point> &ownPoints() {
+            if (points.use_count() > 1) {
+                points = std::make_shared<std::vector<Point>>(*points);
+            }
+            return *points;
+        }
+
+        // Points along the curve
+        std::vector<Point> cells;
+        // Points in the order of insertion, shared with begin() and end()
+        std::shared_ptr<std::vector<Point>> points = std::make_shared<std::vector<Point>>();
+    };
+
+}
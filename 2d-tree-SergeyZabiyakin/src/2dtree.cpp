@@ -1,72 +1,501 @@
 #include "primitives.h"
 
 
-Node::Node(const Point &p, int m) : point(p.x(), p.y()) {
+namespace {
+
+    // Box around no points at all: it is infinitely far from everything
+    template<std::size_t Dim, class Scalar>
+    typename Geometry<Dim, Scalar>::rect emptyBox() {
+        std::array<Scalar, Dim> low, high;
+        low.fill(std::numeric_limits<Scalar>::infinity());
+        high.fill(-std::numeric_limits<Scalar>::infinity());
+        return Geometry<Dim, Scalar>::makeRect(low, high);
+    }
+
+    // Rounds the point outwards to the coordinate type of the box
+    template<std::size_t Dim, class Scalar, class R, class P>
+    R extend(const R &r, const P &p) {
+        std::array<Scalar, Dim> low, high;
+        for (std::size_t axis = 0; axis < Dim; ++axis) {
+            low[axis] = std::min<Scalar>(r.lower(axis), roundDown<Scalar>(p[axis]));
+            high[axis] = std::max<Scalar>(r.upper(axis), roundUp<Scalar>(p[axis]));
+        }
+        return Geometry<Dim, Scalar>::makeRect(low, high);
+    }
+
+    template<std::size_t Dim, class Scalar, class R>
+    R unite(const R &a, const R &b) {
+        std::array<Scalar, Dim> low, high;
+        for (std::size_t axis = 0; axis < Dim; ++axis) {
+            low[axis] = std::min<Scalar>(a.lower(axis), b.lower(axis));
+            high[axis] = std::max<Scalar>(a.upper(axis), b.upper(axis));
+        }
+        return Geometry<Dim, Scalar>::makeRect(low, high);
+    }
+
+    // Split value leaving at least one of the points on each side, Node::dependence
+    // sending keys below it to the left. Prefers the median on the given axis, putting
+    // the points sharing its key on the side that keeps the halves closer, and falls
+    // back to the next axes if all the points share their key on it. The keys are
+    // the coordinates rounded down to K, which part the points as the exact
+    // coordinates do, and there is no split if all of them are equal.
+    template<std::size_t Dim, class K, class It>
+    std::optional<std::pair<int, K>> chooseSplit(It first, It last, int mod) {
+        for (std::size_t step = 0; step < Dim; ++step) {
+            int m = static_cast<int>((mod + step) % Dim);
+            auto key = [m](const auto &item) {
+                return roundDown<K>(item[m]);
+            };
+            auto half = (last - first) / 2;
+            std::nth_element(first, first + half, last, [&key](const auto &a, const auto &b) {
+                return key(a) < key(b);
+            });
+            K split = key(first[half]);
+            std::ptrdiff_t below = 0, upTo = 0;
+            K next = std::numeric_limits<K>::infinity();
+            for (auto it = first; it != last; ++it) {
+                K k = key(*it);
+                below += k < split;
+                upTo += k <= split;
+                if (k > split) {
+                    next = std::min(next, k);
+                }
+            }
+            bool hasNext = upTo < last - first;
+            if (below > 0 && (!hasNext || half - below <= upTo - half)) {
+                return std::pair(m, split);
+            }
+            if (hasNext) {
+                return std::pair(m, next);
+            }
+        }
+        return std::nullopt;
+    }
+
+}
+
+
+template<class Scalar>
+BasicNode<Scalar>::BasicNode(int m, std::uint32_t first, std::uint32_t capacity) : capacity(capacity), first(first) {
     this->mod = m;
 }
 
-const Point &Node::getPoint() const {
-    return point;
+template<class Scalar>
+void BasicNode<Scalar>::setChildren(Scalar s, std::uint32_t left, std::uint32_t right) {
+    split = s;
+    leftNode = left;
+    rightNode = right;
 }
 
-std::shared_ptr<Node> &Node::getLeftNode() {
-    return leftNode;
+template<class Scalar>
+void BasicNode<Scalar>::setCount(std::uint32_t c) {
+    count = c;
 }
 
-std::shared_ptr<Node> &Node::getRightNode() {
-    return rightNode;
+
+template<std::size_t Dim, class Scalar, class Stored>
+BasicTree<Dim, Scalar, Stored>::BasicTree(std::size_t bucketSize) : bucketSize(std::max<std::size_t>(bucketSize, 1)) {
 }
 
-void Node::setLeftNode(Node *node) {
-    Node::leftNode.reset(node);
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::put(const Point &p, std::uint32_t id) {
+    if (nodes.empty()) {
+        newLeaf(0);
+    }
+    path.clear();
+    std::uint32_t index = getRoot();
+    while (!nodes[index].isLeaf()) {
+        Node &node = nodes[index];
+        path.push_back(index);
+        node.setCount(node.getCount() + 1);
+        boxes[index] = extend<Dim, Stored>(boxes[index], p);
+        index = node.dependence(p) ? node.getLeftNode() : node.getRightNode();
+    }
+    boxes[index] = extend<Dim, Stored>(boxes[index], p);
+    Node &leaf = nodes[index];
+    if (leaf.getCount() < leaf.getCapacity()) {
+        store(leaf.getFirst() + leaf.getCount(), Item{p, id});
+        leaf.setCount(leaf.getCount() + 1);
+        return;
+    }
+    splitLeaf(index, Item{p, id});
+    // Only a split makes the tree deeper, its new leaves are path.size() levels down
+    path.push_back(index);
+    if (path.size() > depthLimit(nodes[getRoot()].getCount())) {
+        rebalance();
+    }
 }
 
-void Node::setRightNode(Node *node) {
-    Node::rightNode.reset(node);
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::splitLeaf(std::uint32_t index, const Item &item) {
+    // The new leaves take the freed block first, and a leaf of points no
+    // split parts grows to a bigger one
+    std::vector<Item> items = release(index);
+    items.push_back(item);
+    reallyBuild(index, items.begin(), items.end());
 }
 
-bool Node::isAlive() const {
-    return alive;
+template<std::size_t Dim, class Scalar, class Stored>
+std::size_t BasicTree<Dim, Scalar, Stored>::depthLimit(std::uint32_t count) const {
+    // Leaves of a rebuilt subtree are at least half full
+    double leaves = 2. * count / bucketSize + 1;
+    return static_cast<std::size_t>(std::log(leaves) / -std::log(balance)) + 1;
 }
 
-bool Node::dependence(const Point &p) const {
-    if (mod == 0) {
-        return p.x() < point.x();
-    } else {
-        return p.y() < point.y();
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::rebalance() {
+    // The scapegoat is the lowest node on the path too deep for its size. The
+    // root is one, so there always is such a node.
+    for (std::size_t i = path.size(); i-- > 0;) {
+        if (path.size() - i > depthLimit(nodes[path[i]].getCount())) {
+            rebuild(path[i]);
+            return;
+        }
     }
 }
 
-void Node::setAlive(bool live) {
-    Node::alive = live;
+template<std::size_t Dim, class Scalar, class Stored>
+std::optional<std::uint32_t> BasicTree<Dim, Scalar, Stored>::erase(const Point &p) {
+    if (nodes.empty()) {
+        return std::nullopt;
+    }
+    path.clear();
+    std::uint32_t index = getRoot();
+    while (!nodes[index].isLeaf()) {
+        path.push_back(index);
+        index = nodes[index].dependence(p) ? nodes[index].getLeftNode() : nodes[index].getRightNode();
+    }
+    Node &leaf = nodes[index];
+    std::uint32_t last = leaf.getFirst() + leaf.getCount();
+    std::uint32_t slot = leaf.getFirst();
+    while (slot < last && getPoint(slot) != p) {
+        ++slot;
+    }
+    if (slot == last) {
+        return std::nullopt;
+    }
+    std::uint32_t id = ids[slot];
+    // The last point of the bucket fills the hole
+    store(slot, itemAt(last - 1));
+    leaf.setCount(leaf.getCount() - 1);
+    fitLeaf(index);
+    for (std::size_t i = path.size(); i-- > 0;) {
+        Node &node = nodes[path[i]];
+        node.setCount(node.getCount() - 1);
+        boxes[path[i]] = unite<Dim, Stored>(boxes[node.getLeftNode()], boxes[node.getRightNode()]);
+    }
+    ++erased;
+    compactIfSparse();
+    return id;
 }
 
+template<std::size_t Dim, class Scalar, class Stored>
+std::vector<std::uint32_t> BasicTree<Dim, Scalar, Stored>::eraseRange(const Rect &rect) {
+    std::vector<std::uint32_t> erasedIds;
+    if (nodes.empty()) {
+        return erasedIds;
+    }
+    erased += reallyEraseRange(getRoot(), rect, erasedIds);
+    compactIfSparse();
+    return erasedIds;
+}
 
-void Tree::put(const Point &p) {
-    if (!p_node) {
-        p_node.reset(new Node(p, 0));
+template<std::size_t Dim, class Scalar, class Stored>
+std::uint32_t BasicTree<Dim, Scalar, Stored>::reallyEraseRange(std::uint32_t index, const Rect &rect,
+                                                               std::vector<std::uint32_t> &erasedIds) {
+    if (!intersectsBox<Dim>(rect, boxes[index])) {
+        return 0;
+    }
+    Node &node = nodes[index];
+    std::uint32_t removed = 0;
+    if (node.isLeaf()) {
+        std::uint32_t last = node.getFirst() + node.getCount();
+        for (std::uint32_t slot = node.getFirst(); slot < last;) {
+            if (rect.contains(getPoint(slot))) {
+                erasedIds.push_back(ids[slot]);
+                --last;
+                store(slot, itemAt(last));
+                ++removed;
+            } else {
+                ++slot;
+            }
+        }
+        node.setCount(node.getCount() - removed);
+        fitLeaf(index);
     } else {
-        reallyPut(p_node, p);
+        removed = reallyEraseRange(node.getLeftNode(), rect, erasedIds) +
+                  reallyEraseRange(node.getRightNode(), rect, erasedIds);
+        node.setCount(node.getCount() - removed);
+        boxes[index] = unite<Dim, Stored>(boxes[node.getLeftNode()], boxes[node.getRightNode()]);
+    }
+    return removed;
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::fitLeaf(std::uint32_t index) {
+    boxes[index] = emptyBox<Dim, Stored>();
+    const Node &leaf = nodes[index];
+    for (std::uint32_t slot = leaf.getFirst(); slot < leaf.getFirst() + leaf.getCount(); ++slot) {
+        boxes[index] = extend<Dim, Stored>(boxes[index], getPoint(slot));
     }
 }
 
-void Tree::reallyPut(std::shared_ptr<Node> &node, const Point &p) {
-    if (node->dependence(p)) {
-        if (node->getLeftNode()) {
-            reallyPut(node->getLeftNode(), p);
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::compactIfSparse() {
+    // Rebuilding once as many points were erased as are left keeps the cost
+    // of the empty leaves amortized O(1) per erased point
+    if (erased > nodes[getRoot()].getCount()) {
+        buildItems(release(getRoot()));
+    }
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::rebuild(std::uint32_t index) {
+    std::vector<Item> items = release(index);
+    reallyBuild(index, items.begin(), items.end());
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+auto BasicTree<Dim, Scalar, Stored>::release(std::uint32_t index) -> std::vector<Item> {
+    std::vector<Item> items;
+    items.reserve(nodes[index].getCount());
+    SmallStack<std::uint32_t> stack;
+    stack.push(index);
+    while (!stack.empty()) {
+        std::uint32_t i = stack.pop();
+        const Node &node = nodes[i];
+        if (node.isLeaf()) {
+            for (std::uint32_t slot = node.getFirst(); slot < node.getFirst() + node.getCount(); ++slot) {
+                items.push_back(itemAt(slot));
+            }
+            for (std::uint32_t block = 0; block < node.getCapacity(); block += bucketSize) {
+                freeBlocks.push_back(node.getFirst() + block);
+            }
         } else {
-            node->setLeftNode(new Node(p, (node->mod + 1) % 2));
+            stack.push(node.getLeftNode());
+            stack.push(node.getRightNode());
         }
-    } else {
-        if (node->getRightNode()) {
-            (reallyPut(node->getRightNode(), p));
-        } else {
-            node->setRightNode(new Node(p, (node->mod + 1) % 2));
+        // The subtree keeps its root so that its parent needs no update
+        if (i != index) {
+            freeNodes.push_back(i);
+        }
+    }
+    return items;
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::build(const std::vector<Point> &points) {
+    std::vector<Item> items;
+    items.reserve(points.size());
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        items.push_back(Item{points[i], static_cast<std::uint32_t>(i)});
+    }
+    buildItems(std::move(items));
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::buildItems(std::vector<Item> items) {
+    nodes.clear();
+    boxes.clear();
+    for (auto &c : coords) {
+        c.clear();
+    }
+    ids.clear();
+    freeNodes.clear();
+    freeBlocks.clear();
+    erased = 0;
+    if (!items.empty()) {
+        nodes.reserve(2 * (items.size() / bucketSize) + 1);
+        boxes.reserve(nodes.capacity());
+        reallyBuild(newNode(0, 0), items.begin(), items.end());
+    }
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::reallyBuild(std::uint32_t index, typename std::vector<Item>::iterator first,
+                                                 typename std::vector<Item>::iterator last) {
+    auto count = static_cast<std::uint32_t>(last - first);
+    boxes[index] = emptyBox<Dim, Stored>();
+    std::optional<std::pair<int, Stored>> chosen;
+    if (count > bucketSize) {
+        chosen = chooseSplit<Dim, Stored>(first, last, nodes[index].mod);
+    }
+    if (!chosen) {
+        // Room for twice as many points as a put splitting the leaf finds
+        // equal, so that growing it costs amortized O(1) per point
+        std::uint32_t blocks = 1;
+        while (blocks * bucketSize < count) {
+            blocks *= 2;
+        }
+        nodes[index] = Node(nodes[index].mod, newBlocks(blocks), static_cast<std::uint32_t>(blocks * bucketSize));
+        std::uint32_t slot = nodes[index].getFirst();
+        for (auto it = first; it != last; ++it, ++slot) {
+            store(slot, *it);
+            boxes[index] = extend<Dim, Stored>(boxes[index], it->point);
         }
+        nodes[index].setCount(count);
+        return;
+    }
+    auto [m, split] = *chosen;
+    auto middle = std::partition(first, last, [m = m, split = split](const Item &item) {
+        return item[m] < split;
+    });
+    std::uint32_t left = newNode((m + 1) % Dim, 0);
+    std::uint32_t right = newNode((m + 1) % Dim, 0);
+    nodes[index].mod = m;
+    nodes[index].setChildren(split, left, right);
+    nodes[index].setCount(count);
+    reallyBuild(left, first, middle);
+    reallyBuild(right, middle, last);
+    boxes[index] = unite<Dim, Stored>(boxes[left], boxes[right]);
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+std::uint32_t BasicTree<Dim, Scalar, Stored>::newLeaf(int mod) {
+    return newNode(mod, newBlocks());
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+std::uint32_t BasicTree<Dim, Scalar, Stored>::newBlocks(std::uint32_t blocks) {
+    // Free blocks are not known to be contiguous, so only single ones are reused
+    if (blocks == 1 && !freeBlocks.empty()) {
+        std::uint32_t first = freeBlocks.back();
+        freeBlocks.pop_back();
+        return first;
+    }
+    if (coords[0].size() + blocks * bucketSize >= Node::none) {
+        throw std::length_error("kd-tree point pool is full");
+    }
+    auto first = static_cast<std::uint32_t>(coords[0].size());
+    for (auto &c : coords) {
+        c.resize(c.size() + blocks * bucketSize);
+    }
+    ids.resize(coords[0].size());
+    return first;
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+std::uint32_t BasicTree<Dim, Scalar, Stored>::newNode(int mod, std::uint32_t first) {
+    if (!freeNodes.empty()) {
+        std::uint32_t index = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[index] = Node(mod, first, static_cast<std::uint32_t>(bucketSize));
+        boxes[index] = emptyBox<Dim, Stored>();
+        return index;
+    }
+    if (nodes.size() >= Node::none) {
+        throw std::length_error("kd-tree node pool is full");
+    }
+    nodes.emplace_back(mod, first, static_cast<std::uint32_t>(bucketSize));
+    boxes.push_back(emptyBox<Dim, Stored>());
+    return static_cast<std::uint32_t>(nodes.size() - 1);
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+std::uint32_t BasicTree<Dim, Scalar, Stored>::getRoot() const {
+    return nodes.empty() ? Node::none : 0;
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+std::size_t BasicTree<Dim, Scalar, Stored>::getBucketSize() const {
+    return bucketSize;
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+std::size_t BasicTree<Dim, Scalar, Stored>::getMemoryUsage() const {
+    std::size_t bytes = nodes.capacity() * sizeof(Node) + boxes.capacity() * sizeof(Box) +
+                        ids.capacity() * sizeof(std::uint32_t) +
+                        (freeNodes.capacity() + freeBlocks.capacity() + path.capacity()) * sizeof(std::uint32_t);
+    for (const auto &c : coords) {
+        bytes += c.capacity() * sizeof(Stored);
+    }
+    return bytes;
+}
+
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::store(std::uint32_t slot, const Item &item) {
+    for (std::size_t axis = 0; axis < Dim; ++axis) {
+        coords[axis][slot] = encode(item.point[axis]);
     }
+    ids[slot] = item.id;
 }
 
-std::shared_ptr<Node> Tree::getPNode() const {
-    return p_node;
+template<std::size_t Dim, class Scalar, class Stored>
+auto BasicTree<Dim, Scalar, Stored>::itemAt(std::uint32_t slot) const -> Item {
+    return Item{getPoint(slot), ids[slot]};
 }
 
+template<std::size_t Dim, class Scalar, class Stored>
+void BasicTree<Dim, Scalar, Stored>::remapIds(const std::vector<std::uint32_t> &moved) {
+    // Slots outside the leaves may hold stale ids, which only must not overflow
+    for (auto &i : ids) {
+        i = i < moved.size() ? moved[i] : 0;
+    }
+}
+
+template class BasicNode<double>;
+template class BasicNode<float>;
+template class BasicTree<2, double>;
+template class BasicTree<2, float>;
+template class BasicTree<3, double>;
+template class BasicTree<3, float>;
+template class BasicTree<2, double, float>;
+template class BasicTree<3, double, float>;
+
+
+namespace kdtree {
+
+    template<std::size_t Dim, class Scalar, class Stored>
+    BasicNeighbourIterator<Dim, Scalar, Stored>::BasicNeighbourIterator(const Tree &tree, const Point &query) : tree(&tree), query(query) {
+        push(Entry{boxDistance<Dim>(tree.getBox(tree.getRoot()), query), tree.getRoot(), false});
+        operator++();
+    }
+
+    template<std::size_t Dim, class Scalar, class Stored>
+    BasicNeighbourIterator<Dim, Scalar, Stored> &BasicNeighbourIterator<Dim, Scalar, Stored>::operator++() {
+        // Expands nodes until a point is the closest thing left
+        while (!queue.empty()) {
+            std::pop_heap(queue.begin(), queue.end(), farther);
+            Entry entry = queue.back();
+            queue.pop_back();
+            if (entry.point) {
+                current = tree->getPoint(entry.index);
+                return *this;
+            }
+            const auto &node = tree->getNode(entry.index);
+            if (node.getCount() == 0) {
+                continue;
+            }
+            if (node.isLeaf()) {
+                for (std::uint32_t slot = node.getFirst(); slot < node.getFirst() + node.getCount(); ++slot) {
+                    push(Entry{tree->getPoint(slot).squaredDistance(query), slot, true});
+                }
+            } else {
+                for (std::uint32_t child : {node.getLeftNode(), node.getRightNode()}) {
+                    push(Entry{boxDistance<Dim>(tree->getBox(child), query), child, false});
+                }
+            }
+        }
+        tree = nullptr;
+        return *this;
+    }
+
+    template<std::size_t Dim, class Scalar, class Stored>
+    bool BasicNeighbourIterator<Dim, Scalar, Stored>::farther(const Entry &a, const Entry &b) {
+        return a.distance != b.distance ? a.distance > b.distance : a.point < b.point;
+    }
+
+    template<std::size_t Dim, class Scalar, class Stored>
+    void BasicNeighbourIterator<Dim, Scalar, Stored>::push(const Entry &entry) {
+        queue.push_back(entry);
+        std::push_heap(queue.begin(), queue.end(), farther);
+    }
+
+    template class BasicNeighbourIterator<2, double>;
+    template class BasicNeighbourIterator<2, float>;
+    template class BasicNeighbourIterator<3, double>;
+    template class BasicNeighbourIterator<3, float>;
+    template class BasicNeighbourIterator<2, double, float>;
+    template class BasicNeighbourIterator<3, double, float>;
+
+}
@@ -0,0 +1,147 @@
+#include "grid.h"
+
+
+void grid::PointSet::put(const Point &p) {
+    if (contains(p)) {
+        return;
+    }
+    ownPoints().push_back(p);
+    if (points->size() > 2 * laidOutFor || !frame.contains(p)) {
+        layOut();
+        return;
+    }
+    std::size_t cell = cellOf(p);
+    cellPoints.insert(cellPoints.begin() + starts[cell + 1], p);
+    for (std::size_t i = cell + 1; i < starts.size(); ++i) {
+        ++starts[i];
+    }
+}
+
+bool grid::PointSet::contains(const Point &p) const {
+    if (cellPoints.empty()) {
+        return false;
+    }
+    std::size_t cell = cellOf(p);
+    auto first = cellPoints.begin() + starts[cell], last = cellPoints.begin() + starts[cell + 1];
+    return std::find(first, last, p) != last;
+}
+
+void grid::PointSet::layOut() {
+    const std::vector<Point> &all = *points;
+    laidOutFor = all.size();
+    cellPoints.clear();
+    starts.clear();
+    if (all.empty()) {
+        side = 0;
+        return;
+    }
+    double xmin = all.front().x(), xmax = xmin, ymin = all.front().y(), ymax = ymin;
+    for (const Point &p : all) {
+        xmin = std::min(xmin, p.x());
+        xmax = std::max(xmax, p.x());
+        ymin = std::min(ymin, p.y());
+        ymax = std::max(ymax, p.y());
+    }
+    frame = Rect(Point(xmin, ymin), Point(xmax, ymax));
+    side = std::max<std::size_t>(1, static_cast<std::size_t>(std::sqrt(all.size() / 2.)));
+    xScale = xmax > xmin ? side / (xmax - xmin) : 0;
+    yScale = ymax > ymin ? side / (ymax - ymin) : 0;
+
+    // Counting sort into the cells
+    starts.assign(side * side + 1, 0);
+    for (const Point &p : all) {
+        ++starts[cellOf(p) + 1];
+    }
+    std::partial_sum(starts.begin(), starts.end(), starts.begin());
+    std::vector<std::uint32_t> next(starts.begin(), starts.end() - 1);
+    cellPoints.resize(all.size());
+    for (const Point &p : all) {
+        cellPoints[next[cellOf(p)]++] = p;
+    }
+}
+
+std::optional<Point> grid::PointSet::nearest(const Point &p) const {
+    std::vector<Point> result = nearestPoints(p, 1);
+    if (result.empty()) {
+        return std::nullopt;
+    }
+    return result.front();
+}
+
+std::vector<Point> grid::PointSet::nearestPoints(const Point &p, std::size_t k) const {
+    k = std::min(k, cellPoints.size());
+    if (k == 0) {
+        return {};
+    }
+    std::vector<std::pair<double, Point>> heap;
+    heap.reserve(k);
+    auto scan = [&](std::size_t y, std::size_t left, std::size_t right) {
+        for (std::uint32_t i = starts[y * side + left]; i < starts[y * side + right + 1]; ++i) {
+            std::pair<double, Point> candidate(cellPoints[i].squaredDistance(p), cellPoints[i]);
+            if (heap.size() < k) {
+                heap.push_back(candidate);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (candidate < heap.front()) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = candidate;
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    };
+    // Cell edges are recomputed from the scales, so gaps are shrunk by a few
+    // rounding errors to stay lower bounds
+    double slack = 4 * std::numeric_limits<double>::epsilon() *
+                   (std::abs(frame.xmin()) + std::abs(frame.xmax()) + std::abs(frame.ymin()) +
+                    std::abs(frame.ymax()) + std::abs(p.x()) + std::abs(p.y()));
+    auto cx = static_cast<std::ptrdiff_t>(column(p.x())), cy = static_cast<std::ptrdiff_t>(row(p.y()));
+    auto n = static_cast<std::ptrdiff_t>(side);
+    for (std::ptrdiff_t d = 0;; ++d) {
+        // Ring d: whole rows at its top and bottom, single cells at its sides
+        std::size_t left = static_cast<std::size_t>(std::max<std::ptrdiff_t>(cx - d, 0));
+        std::size_t right = static_cast<std::size_t>(std::min(cx + d, n - 1));
+        for (std::ptrdiff_t y = std::max<std::ptrdiff_t>(cy - d, 0); y <= std::min(cy + d, n - 1); ++y) {
+            auto row = static_cast<std::size_t>(y);
+            if (y == cy - d || y == cy + d) {
+                scan(row, left, right);
+            } else {
+                if (cx - d >= 0) {
+                    scan(row, left, left);
+                }
+                if (cx + d < n && d > 0) {
+                    scan(row, right, right);
+                }
+            }
+        }
+
+        // Distance to the cells beyond the ring, on the sides that have any
+        double gap = std::numeric_limits<double>::infinity();
+        bool more = false;
+        if (cx - d > 0) {
+            more = true;
+            gap = std::min(gap, p.x() - (frame.xmin() + double(cx - d) / xScale));
+        }
+        if (cx + d + 1 < n) {
+            more = true;
+            gap = std::min(gap, frame.xmin() + double(cx + d + 1) / xScale - p.x());
+        }
+        if (cy - d > 0) {
+            more = true;
+            gap = std::min(gap, p.y() - (frame.ymin() + double(cy - d) / yScale));
+        }
+        if (cy + d + 1 < n) {
+            more = true;
+            gap = std::min(gap, frame.ymin() + double(cy + d + 1) / yScale - p.y());
+        }
+        gap -= slack;
+        if (!more || (heap.size() == k && gap > 0 && gap * gap > heap.front().first)) {
+            break;
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end());
+    std::vector<Point> result;
+    result.reserve(k);
+    for (const auto &candidate : heap) {
+        result.push_back(candidate.second);
+    }
+    return result;
+}
@@ -0,0 +1,198 @@
+#include "quadtree.h"
+
+
+void quadtree::PointSet::put(const Point &p) {
+    if (!std::isfinite(p.x()) || !std::isfinite(p.y())) {
+        throw std::invalid_argument("quadtree can't place a point at infinity");
+    }
+    if (contains(p)) {
+        return;
+    }
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        root = Square{std::floor(p.x()), std::floor(p.y()), 1};
+    }
+    grow(p);
+    ownPoints().push_back(p);
+    std::uint32_t index = 0;
+    Square s = root;
+    while (nodes[index].children != none) {
+        std::uint32_t q = quadrantOf(s, p);
+        index = nodes[index].children + q;
+        s = quadrant(s, q);
+    }
+    store(index, p);
+    if (nodes[index].count > bucketSize) {
+        split(index, s);
+    }
+}
+
+bool quadtree::PointSet::contains(const Point &p) const {
+    if (nodes.empty() || !covers(p)) {
+        return false;
+    }
+    std::uint32_t index = 0;
+    Square s = root;
+    while (nodes[index].children != none) {
+        std::uint32_t q = quadrantOf(s, p);
+        index = nodes[index].children + q;
+        s = quadrant(s, q);
+    }
+    const Node &leaf = nodes[index];
+    if (leaf.count == 0) {
+        return false;
+    }
+    auto first = slots.begin() + leaf.first, last = first + leaf.count;
+    return std::find(first, last, p) != last;
+}
+
+void quadtree::PointSet::grow(const Point &p) {
+    // Corners stay multiples of power of two sizes, so the old root is
+    // exactly one quadrant of the doubled one and halving is exact
+    while (!covers(p)) {
+        Square bigger{p.x() < root.x ? root.x - root.size : root.x, p.y() < root.y ? root.y - root.size : root.y,
+                      2 * root.size};
+        if (!std::isfinite(bigger.x) || !std::isfinite(bigger.y) || !std::isfinite(bigger.size)) {
+            cover();
+            return;
+        }
+        // A leaf keeps its points wherever its square is
+        if (nodes[0].children != none) {
+            std::uint32_t children = newChildren();
+            std::swap(nodes[0], nodes[children + quadrantOf(bigger, Point(root.x, root.y))]);
+            nodes[0].children = children;
+        }
+        root = bigger;
+    }
+}
+
+void quadtree::PointSet::cover() {
+    // No finite square holds points this far apart: the root becomes one leaf
+    // over the whole plane, which split refuses to halve
+    nodes.assign(1, Node());
+    slots.clear();
+    root = Square{std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(),
+                  std::numeric_limits<double>::infinity()};
+    for (const Point &p : *points) {
+        store(0, p);
+    }
+}
+
+void quadtree::PointSet::store(std::uint32_t index, const Point &p) {
+    if (nodes[index].count == nodes[index].capacity) {
+        // Only leaves too small to split outgrow a block
+        std::uint32_t capacity = std::max<std::uint32_t>(static_cast<std::uint32_t>(bucketSize + 1),
+                                                         2 * nodes[index].capacity);
+        if (slots.size() + capacity >= none) {
+            throw std::length_error("quadtree point pool is full");
+        }
+        auto first = static_cast<std::uint32_t>(slots.size());
+        slots.resize(slots.size() + capacity);
+        Node &node = nodes[index];
+        if (node.count != 0) {
+            std::copy(slots.begin() + node.first, slots.begin() + node.first + node.count, slots.begin() + first);
+        }
+        node.first = first;
+        node.capacity = capacity;
+    }
+    Node &node = nodes[index];
+    slots[node.first + node.count++] = p;
+}
+
+void quadtree::PointSet::split(std::uint32_t index, const Square &s) {
+    // Too small or too big a square to halve: the leaf grows past its bucket instead
+    if (s.x + s.size / 2 == s.x || s.y + s.size / 2 == s.y || !std::isfinite(s.size)) {
+        return;
+    }
+    // The children take the block over one by one, so its points are copied out first
+    std::vector<Point> moved(slots.begin() + nodes[index].first,
+                             slots.begin() + nodes[index].first + nodes[index].count);
+    std::uint32_t children = newChildren();
+    std::uint32_t reused = nodes[index].first, capacity = nodes[index].capacity;
+    nodes[index] = Node();
+    nodes[index].children = children;
+    for (const Point &p : moved) {
+        std::uint32_t child = children + quadrantOf(s, p);
+        if (nodes[child].capacity == 0 && capacity != 0) {
+            // The first child to get a point takes the old block
+            nodes[child].first = reused;
+            nodes[child].capacity = capacity;
+            capacity = 0;
+        }
+        store(child, p);
+    }
+    for (std::uint32_t q = 0; q < 4; ++q) {
+        if (nodes[children + q].count > bucketSize) {
+            split(children + q, quadrant(s, q));
+        }
+    }
+}
+
+std::uint32_t quadtree::PointSet::newChildren() {
+    if (nodes.size() + 4 >= none) {
+        throw std::length_error("quadtree node pool is full");
+    }
+    auto first = static_cast<std::uint32_t>(nodes.size());
+    nodes.resize(nodes.size() + 4);
+    return first;
+}
+
+std::optional<Point> quadtree::PointSet::nearest(const Point &p) const {
+    std::vector<Point> result = nearestPoints(p, 1);
+    if (result.empty()) {
+        return std::nullopt;
+    }
+    return result.front();
+}
+
+std::vector<Point> quadtree::PointSet::nearestPoints(const Point &p, std::size_t k) const {
+    k = std::min(k, size());
+    if (k == 0) {
+        return {};
+    }
+    std::vector<std::pair<double, Point>> heap;
+    heap.reserve(k);
+    SmallStack<Frame> stack;
+    stack.push(Frame{0, root});
+    while (!stack.empty()) {
+        Frame frame = stack.pop();
+        // The heap may have got better since the node was pushed
+        if (heap.size() == k && squaredDistance(frame.square, p) >= heap.front().first) {
+            continue;
+        }
+        const Node &node = nodes[frame.index];
+        if (node.children == none) {
+            for (std::uint32_t i = node.first; i < node.first + node.count; ++i) {
+                std::pair<double, Point> candidate(slots[i].squaredDistance(p), slots[i]);
+                if (heap.size() < k) {
+                    heap.push_back(candidate);
+                    std::push_heap(heap.begin(), heap.end());
+                } else if (candidate < heap.front()) {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = candidate;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+            continue;
+        }
+        // The closest quadrant goes first, so it is pushed last
+        std::pair<double, std::uint32_t> order[4];
+        for (std::uint32_t q = 0; q < 4; ++q) {
+            order[q] = std::pair(squaredDistance(quadrant(frame.square, q), p), q);
+        }
+        std::sort(order, order + 4);
+        for (int i = 3; i >= 0; --i) {
+            if (heap.size() < k || order[i].first < heap.front().first) {
+                std::uint32_t q = order[i].second;
+                stack.push(Frame{node.children + q, quadrant(frame.square, q)});
+            }
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end());
+    std::vector<Point> result;
+    result.reserve(k);
+    for (const auto &candidate : heap) {
+        result.push_back(candidate.second);
+    }
+    return result;
+}
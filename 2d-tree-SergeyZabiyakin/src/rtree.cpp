@@ -0,0 +1,124 @@
+#include "rtree.h"
+
+
+namespace {
+
+    Rect unite(const Rect &a, const Rect &b) {
+        return Rect(Point(std::min(a.xmin(), b.xmin()), std::min(a.ymin(), b.ymin())),
+                    Point(std::max(a.xmax(), b.xmax()), std::max(a.ymax(), b.ymax())));
+    }
+
+    // Orders the items for packing into groups of fanout: sorted by the x of
+    // their centres, cut into about sqrt(groups) slices of whole groups, and
+    // every slice sorted by the y of the centres
+    template<class T, class Box>
+    void tile(std::vector<T> &items, std::size_t fanout, Box box) {
+        auto centre = [&box](const T &item, std::size_t axis) {
+            const Rect &r = box(item);
+            return r.lower(axis) / 2 + r.upper(axis) / 2;
+        };
+        std::size_t groups = (items.size() + fanout - 1) / fanout;
+        auto slices = static_cast<std::size_t>(std::ceil(std::sqrt(double(groups))));
+        std::size_t perSlice = ((groups + slices - 1) / slices) * fanout;
+        std::sort(items.begin(), items.end(), [&](const T &a, const T &b) {
+            return centre(a, 0) < centre(b, 0);
+        });
+        for (std::size_t first = 0; first < items.size(); first += perSlice) {
+            auto last = items.begin() + static_cast<std::ptrdiff_t>(std::min(items.size(), first + perSlice));
+            std::sort(items.begin() + static_cast<std::ptrdiff_t>(first), last, [&](const T &a, const T &b) {
+                return centre(a, 1) < centre(b, 1);
+            });
+        }
+    }
+
+}
+
+rtree::RectSet::RectSet(std::vector<Rect> all) {
+    if (all.empty()) {
+        return;
+    }
+    if (all.size() >= std::numeric_limits<std::uint32_t>::max()) {
+        throw std::length_error("r-tree can't index that many rectangles");
+    }
+    auto self = [](const Rect &r) -> const Rect & { return r; };
+    auto boxOf = [](const Node &node) -> const Rect & { return node.box; };
+
+    tile(all, fanout, self);
+    std::vector<Node> level;
+    for (std::size_t i = 0; i < all.size(); i += fanout) {
+        Node node{all[i], static_cast<std::uint32_t>(i), static_cast<std::uint32_t>(std::min(fanout, all.size() - i))};
+        for (std::uint32_t j = 1; j < node.count; ++j) {
+            node.box = unite(node.box, all[i + j]);
+        }
+        level.push_back(node);
+    }
+    leaves = level.size();
+    // Every level is tiled before its parents take runs of it
+    while (level.size() > 1) {
+        tile(level, fanout, boxOf);
+        std::size_t offset = nodes.size();
+        nodes.insert(nodes.end(), level.begin(), level.end());
+        std::vector<Node> parents;
+        for (std::size_t i = 0; i < level.size(); i += fanout) {
+            Node node{level[i].box, static_cast<std::uint32_t>(offset + i),
+                      static_cast<std::uint32_t>(std::min(fanout, level.size() - i))};
+            for (std::uint32_t j = 1; j < node.count; ++j) {
+                node.box = unite(node.box, level[i + j].box);
+            }
+            parents.push_back(node);
+        }
+        level = std::move(parents);
+    }
+    nodes.push_back(level.front());
+    rects = std::make_shared<const std::vector<Rect>>(std::move(all));
+}
+
+std::optional<Rect> rtree::RectSet::nearest(const Point &p) const {
+    std::vector<Rect> result = nearestRects(p, 1);
+    if (result.empty()) {
+        return std::nullopt;
+    }
+    return result.front();
+}
+
+std::vector<Rect> rtree::RectSet::nearestRects(const Point &p, std::size_t k) const {
+    std::vector<Rect> result;
+    if (nodes.empty() || k == 0) {
+        return result;
+    }
+    result.reserve(std::min(k, size()));
+    // Best first: nodes and rectangles wait in one queue by their distance,
+    // so a rectangle coming out first is closer than anything left
+    struct Entry {
+        double distance;
+        std::uint32_t index;
+        bool rect;
+
+        bool operator<(const Entry &e) const {
+            return distance != e.distance ? distance > e.distance : rect < e.rect;
+        }
+    };
+    std::vector<Entry> queue;
+    auto push = [&queue](const Entry &entry) {
+        queue.push_back(entry);
+        std::push_heap(queue.begin(), queue.end());
+    };
+    auto root = static_cast<std::uint32_t>(nodes.size() - 1);
+    push(Entry{nodes[root].box.squaredDistance(p), root, false});
+    while (!queue.empty() && result.size() < k) {
+        std::pop_heap(queue.begin(), queue.end());
+        Entry entry = queue.back();
+        queue.pop_back();
+        if (entry.rect) {
+            result.push_back((*rects)[entry.index]);
+            continue;
+        }
+        const Node &node = nodes[entry.index];
+        bool leaf = entry.index < leaves;
+        for (std::uint32_t i = node.first; i < node.first + node.count; ++i) {
+            const Rect &box = leaf ? (*rects)[i] : nodes[i].box;
+            push(Entry{box.squaredDistance(p), i, leaf});
+        }
+    }
+    return result;
+}
@@ -0,0 +1,190 @@
+#include "simd.h"
+
+#include <limits>
+#include <string_view>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+    void scalarDistances(const double *xs, const double *ys, std::size_t n, double px, double py, double *out) {
+        for (std::size_t i = 0; i < n; ++i) {
+            double dx = xs[i] - px, dy = ys[i] - py;
+            out[i] = dx * dx + dy * dy;
+        }
+    }
+
+    std::size_t scalarNearest(const double *xs, const double *ys, std::size_t n, double px, double py,
+                              double &distance, std::size_t from = 0) {
+        std::size_t best = from;
+        double min = std::numeric_limits<double>::infinity();
+        for (std::size_t i = from; i < n; ++i) {
+            double dx = xs[i] - px, dy = ys[i] - py;
+            double d = dx * dx + dy * dy;
+            if (d < min) {
+                min = d;
+                best = i;
+            }
+        }
+        distance = min;
+        return best;
+    }
+
+    // Merges the best of the vector lanes with the best of the scalar tail,
+    // ties going to the smaller index as in the scalar code
+    std::size_t pickBest(const double *d, const double *index, std::size_t lanes, std::size_t tailIndex,
+                         double tailDistance, double &distance) {
+        std::size_t best = tailIndex;
+        double min = tailDistance;
+        for (std::size_t l = 0; l < lanes; ++l) {
+            auto i = static_cast<std::size_t>(index[l]);
+            if (d[l] < min || (d[l] == min && i < best)) {
+                min = d[l];
+                best = i;
+            }
+        }
+        distance = min;
+        return best;
+    }
+
+#ifdef SIMD_X86
+    __attribute__((target("avx2")))
+    void avx2Distances(const double *xs, const double *ys, std::size_t n, double px, double py, double *out) {
+        __m256d qx = _mm256_set1_pd(px), qy = _mm256_set1_pd(py);
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(xs + i), qx);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(ys + i), qy);
+            _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)));
+        }
+        scalarDistances(xs + i, ys + i, n - i, px, py, out + i);
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t avx2Nearest(const double *xs, const double *ys, std::size_t n, double px, double py,
+                            double &distance) {
+        __m256d qx = _mm256_set1_pd(px), qy = _mm256_set1_pd(py);
+        __m256d min = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+        __m256d index = _mm256_setzero_pd();
+        __m256d current = _mm256_setr_pd(0, 1, 2, 3);
+        __m256d step = _mm256_set1_pd(4);
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(xs + i), qx);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(ys + i), qy);
+            __m256d d = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+            __m256d closer = _mm256_cmp_pd(d, min, _CMP_LT_OQ);
+            min = _mm256_blendv_pd(min, d, closer);
+            index = _mm256_blendv_pd(index, current, closer);
+            current = _mm256_add_pd(current, step);
+        }
+        alignas(32) double d[4], idx[4];
+        _mm256_store_pd(d, min);
+        _mm256_store_pd(idx, index);
+        double tail;
+        std::size_t tailIndex = scalarNearest(xs, ys, n, px, py, tail, i);
+        return pickBest(d, idx, 4, tailIndex, tail, distance);
+    }
+
+    __attribute__((target("avx512f")))
+    void avx512Distances(const double *xs, const double *ys, std::size_t n, double px, double py, double *out) {
+        __m512d qx = _mm512_set1_pd(px), qy = _mm512_set1_pd(py);
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(xs + i), qx);
+            __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(ys + i), qy);
+            _mm512_storeu_pd(out + i, _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)));
+        }
+        scalarDistances(xs + i, ys + i, n - i, px, py, out + i);
+    }
+
+    __attribute__((target("avx512f")))
+    std::size_t avx512Nearest(const double *xs, const double *ys, std::size_t n, double px, double py,
+                              double &distance) {
+        __m512d qx = _mm512_set1_pd(px), qy = _mm512_set1_pd(py);
+        __m512d min = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+        __m512d index = _mm512_setzero_pd();
+        __m512d current = _mm512_setr_pd(0, 1, 2, 3, 4, 5, 6, 7);
+        __m512d step = _mm512_set1_pd(8);
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(xs + i), qx);
+            __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(ys + i), qy);
+            __m512d d = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy));
+            __mmask8 closer = _mm512_cmp_pd_mask(d, min, _CMP_LT_OQ);
+            min = _mm512_mask_blend_pd(closer, min, d);
+            index = _mm512_mask_blend_pd(closer, index, current);
+            current = _mm512_add_pd(current, step);
+        }
+        alignas(64) double d[8], idx[8];
+        _mm512_store_pd(d, min);
+        _mm512_store_pd(idx, index);
+        double tail;
+        std::size_t tailIndex = scalarNearest(xs, ys, n, px, py, tail, i);
+        return pickBest(d, idx, 8, tailIndex, tail, distance);
+    }
+#endif
+
+    using simd::detail::Kernels;
+
+    std::size_t scalarNearestAll(const double *xs, const double *ys, std::size_t n, double px, double py,
+                                 double &distance) {
+        return scalarNearest(xs, ys, n, px, py, distance);
+    }
+
+    const Kernels scalar{scalarDistances, scalarNearestAll, "scalar"};
+#ifdef SIMD_X86
+    const Kernels avx2{avx2Distances, avx2Nearest, "avx2"};
+    const Kernels avx512{avx512Distances, avx512Nearest, "avx512"};
+#endif
+
+    // The widest first
+    const Kernels &select() {
+        for (const char *name : {"avx512", "avx2"}) {
+            if (const Kernels *k = simd::detail::kernelsFor(name)) {
+                return *k;
+            }
+        }
+        return scalar;
+    }
+
+    const Kernels &kernels() {
+        static const Kernels &k = select();
+        return k;
+    }
+
+}
+
+const simd::detail::Kernels *simd::detail::kernelsFor(const char *name) {
+    std::string_view wanted(name);
+    if (wanted == scalar.name) {
+        return &scalar;
+    }
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (wanted == avx512.name && __builtin_cpu_supports("avx512f")) {
+        return &avx512;
+    }
+    if (wanted == avx2.name && __builtin_cpu_supports("avx2")) {
+        return &avx2;
+    }
+#endif
+    return nullptr;
+}
+
+void simd::squaredDistances(const double *xs, const double *ys, std::size_t n, double px, double py, double *out) {
+    kernels().distances(xs, ys, n, px, py, out);
+}
+
+std::size_t simd::nearestIndex(const double *xs, const double *ys, std::size_t n, double px, double py,
+                               double &distance) {
+    return kernels().nearest(xs, ys, n, px, py, distance);
+}
+
+const char *simd::kernelName() {
+    return kernels().name;
+}
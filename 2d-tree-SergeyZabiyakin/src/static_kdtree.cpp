@@ -0,0 +1,157 @@
+#include "static_kdtree.h"
+
+
+namespace {
+
+    // Size of the left subtree of a complete binary tree with n nodes
+    std::size_t leftSize(std::size_t n) {
+        if (n <= 1) {
+            return 0;
+        }
+        std::size_t last = 1;
+        while (last * 2 <= n) {
+            last *= 2;
+        }
+        // last is now the capacity of the bottom level
+        std::size_t above = last - 1;
+        return (above - 1) / 2 + std::min(n - above, last / 2);
+    }
+
+    double key(const Point &p, int depth) {
+        return depth % 2 == 0 ? p.x() : p.y();
+    }
+
+}
+
+kdtree::StaticPointSet::StaticPointSet(std::vector<Point> points) {
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    if (points.empty()) {
+        return;
+    }
+    double xmin = points.front().x(), xmax = points.back().x();
+    double ymin = points.front().y(), ymax = points.front().y();
+    for (const Point &p : points) {
+        ymin = std::min(ymin, p.y());
+        ymax = std::max(ymax, p.y());
+    }
+    box = Rect(Point(xmin, ymin), Point(xmax, ymax));
+    std::vector<Point> tree(points.size());
+    build(tree, 0, points.begin(), points.end(), 0);
+    nodes = std::make_shared<const std::vector<Point>>(std::move(tree));
+}
+
+void kdtree::StaticPointSet::build(std::vector<Point> &tree, std::size_t index, std::vector<Point>::iterator first,
+                                   std::vector<Point>::iterator last, int depth) {
+    if (first == last) {
+        return;
+    }
+    auto middle = first + leftSize(last - first);
+    std::nth_element(first, middle, last, [depth](const Point &a, const Point &b) {
+        return key(a, depth) < key(b, depth);
+    });
+    tree[index] = *middle;
+    build(tree, 2 * index + 1, first, middle, depth + 1);
+    build(tree, 2 * index + 2, middle + 1, last, depth + 1);
+}
+
+bool kdtree::StaticPointSet::contains(const Point &p) const {
+    return !nodes->empty() && utilityForContains(0, 0, p);
+}
+
+std::pair<kdtree::StaticPointSet::ForwardIt, kdtree::StaticPointSet::ForwardIt>
+kdtree::StaticPointSet::range(const Rect &rect) const {
+    std::vector<Point> result;
+    if (!nodes->empty()) {
+        utilityForRange(rect, 0, 0, result);
+    }
+    return makeRange(std::move(result));
+}
+
+std::optional<Point> kdtree::StaticPointSet::nearest(const Point &p) const {
+    if (nodes->empty()) return std::nullopt;
+    std::vector<Candidate> heap;
+    utilityForNearest(box, 0, 0, p, 1, heap);
+    return (*nodes)[heap.front().second];
+}
+
+std::pair<kdtree::StaticPointSet::ForwardIt, kdtree::StaticPointSet::ForwardIt>
+kdtree::StaticPointSet::nearest(const Point &p, std::size_t k) const {
+    std::vector<Candidate> heap;
+    if (!nodes->empty() && k != 0) {
+        utilityForNearest(box, 0, 0, p, k, heap);
+    }
+    std::sort_heap(heap.begin(), heap.end());
+    std::vector<Point> result;
+    result.reserve(heap.size());
+    for (const Candidate &c : heap) {
+        result.push_back((*nodes)[c.second]);
+    }
+    return makeRange(std::move(result));
+}
+
+bool kdtree::StaticPointSet::utilityForContains(std::size_t index, int depth, const Point &p) const {
+    if (index >= nodes->size()) {
+        return false;
+    }
+    const Point &point = (*nodes)[index];
+    if (point == p) {
+        return true;
+    }
+    // Equal keys may end up on either side of a node
+    double k = key(p, depth), split = key(point, depth);
+    return (k <= split && utilityForContains(2 * index + 1, depth + 1, p))
+           || (k >= split && utilityForContains(2 * index + 2, depth + 1, p));
+}
+
+void kdtree::StaticPointSet::utilityForRange(const Rect &rect, std::size_t index, int depth,
+                                             std::vector<Point> &result) const {
+    if (index >= nodes->size()) {
+        return;
+    }
+    const Point &point = (*nodes)[index];
+    if (rect.contains(point)) {
+        result.push_back(point);
+    }
+    // Only the part of the query lying on each side of the split goes down
+    auto pair = depth % 2 == 0 ? rect.splitX(point.x()) : rect.splitY(point.y());
+    if (pair.first.has_value()) {
+        utilityForRange(*pair.first, 2 * index + 1, depth + 1, result);
+    }
+    if (pair.second.has_value()) {
+        utilityForRange(*pair.second, 2 * index + 2, depth + 1, result);
+    }
+}
+
+void kdtree::StaticPointSet::utilityForNearest(const Rect &region, std::size_t index, int depth, const Point &p,
+                                               std::size_t k, std::vector<Candidate> &heap) const {
+    if (index >= nodes->size()) {
+        return;
+    }
+    if (heap.size() == k && region.squaredDistance(p) >= heap.front().first) {
+        return;
+    }
+    const Point &point = (*nodes)[index];
+    double distance = point.squaredDistance(p);
+    if (heap.size() < k) {
+        heap.emplace_back(distance, index);
+        std::push_heap(heap.begin(), heap.end());
+    } else if (distance < heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = Candidate(distance, index);
+        std::push_heap(heap.begin(), heap.end());
+    }
+    auto pair = depth % 2 == 0 ? region.splitX(point.x()) : region.splitY(point.y());
+    // Go first to the side the query point would have been put into
+    bool leftFirst = key(p, depth) < key(point, depth);
+    const std::optional<Rect> &near = leftFirst ? pair.first : pair.second;
+    const std::optional<Rect> &far = leftFirst ? pair.second : pair.first;
+    std::size_t nearIndex = leftFirst ? 2 * index + 1 : 2 * index + 2;
+    std::size_t farIndex = leftFirst ? 2 * index + 2 : 2 * index + 1;
+    if (near.has_value()) {
+        utilityForNearest(*near, nearIndex, depth + 1, p, k, heap);
+    }
+    if (far.has_value()) {
+        utilityForNearest(*far, farIndex, depth + 1, p, k, heap);
+    }
+}
@@ -0,0 +1,116 @@
+#include "workers.h"
+
+#include <algorithm>
+#include <exception>
+
+
+struct WorkerPool::Job {
+    const std::function<void(std::size_t)> *task;
+    std::size_t count;
+    // Tasks started and tasks done or skipped, both guarded by the pool's mutex
+    std::size_t next = 0;
+    std::size_t done = 0;
+    std::exception_ptr error;
+    std::condition_variable finished;
+
+    Job(const std::function<void(std::size_t)> *task, std::size_t count) : task(task), count(count) {}
+};
+
+WorkerPool::WorkerPool(std::size_t workers) {
+    // Threads started before one failed to start must not be left joinable
+    try {
+        threads.reserve(workers);
+        for (std::size_t i = 0; i < workers; ++i) {
+            threads.emplace_back([this] { work(); });
+        }
+    } catch (...) {
+        stop();
+        throw;
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+WorkerPool &WorkerPool::shared() {
+    static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+void WorkerPool::run(std::size_t count, const std::function<void(std::size_t)> &task) {
+    if (count == 0) {
+        return;
+    }
+    auto job = std::make_shared<Job>(&task, count);
+    std::unique_lock<std::mutex> lock(mutex);
+    if (count > 1 && !threads.empty()) {
+        jobs.push_back(job);
+        wake.notify_all();
+    }
+    while (runNext(job, lock)) {
+    }
+    job->finished.wait(lock, [&job] { return job->done == job->count; });
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+}
+
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty()) {
+            return;
+        }
+        std::shared_ptr<Job> job = jobs.front();
+        runNext(job, lock);
+    }
+}
+
+bool WorkerPool::runNext(const std::shared_ptr<Job> &job, std::unique_lock<std::mutex> &lock) {
+    auto unqueue = [this, &job] {
+        jobs.erase(std::remove(jobs.begin(), jobs.end(), job), jobs.end());
+    };
+    if (job->next == job->count) {
+        return false;
+    }
+    std::size_t i = job->next++;
+    if (job->next == job->count) {
+        unqueue();
+    }
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+        (*job->task)(i);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+    ++job->done;
+    if (error) {
+        if (!job->error) {
+            job->error = error;
+        }
+        // Nobody waits for the results of a failed job
+        job->done += job->count - job->next;
+        job->next = job->count;
+        unqueue();
+    }
+    if (job->done == job->count) {
+        job->finished.notify_all();
+    }
+    return true;
+}
@@ -0,0 +1,147 @@
+#include "zorder.h"
+
+
+void zorder::PointSet::put(const Point &p) {
+    Code c = code(p);
+    std::size_t at = lowerBound(0, c);
+    if (at < cells.size() && code(cells[at]) == c) {
+        return;
+    }
+    cells.insert(cells.begin() + static_cast<std::ptrdiff_t>(at), p);
+    ownPoints().push_back(p);
+}
+
+bool zorder::PointSet::contains(const Point &p) const {
+    Code c = code(p);
+    std::size_t at = lowerBound(0, c);
+    return at < cells.size() && code(cells[at]) == c;
+}
+
+std::optional<Point> zorder::PointSet::nearest(const Point &p) const {
+    std::vector<Point> result = nearestPoints(p, 1);
+    if (result.empty()) {
+        return std::nullopt;
+    }
+    return result.front();
+}
+
+std::vector<Point> zorder::PointSet::nearestPoints(const Point &p, std::size_t k) const {
+    k = std::min(k, cells.size());
+    if (k == 0) {
+        return {};
+    }
+    // The 2k points around p on the curve bound the distance to the k-th
+    // neighbour, and all the points closer than that are in the square around p
+    std::size_t at = lowerBound(0, code(p));
+    std::size_t last = std::min(cells.size(), (at > k ? at - k : 0) + 2 * k);
+    std::size_t first = last > 2 * k ? last - 2 * k : 0;
+    std::vector<double> distances;
+    distances.reserve(last - first);
+    for (std::size_t i = first; i < last; ++i) {
+        distances.push_back(cells[i].squaredDistance(p));
+    }
+    std::nth_element(distances.begin(), distances.begin() + static_cast<std::ptrdiff_t>(k - 1), distances.end());
+    double r = std::nextafter(std::sqrt(distances[k - 1]), std::numeric_limits<double>::infinity());
+
+    std::vector<std::pair<double, Point>> heap;
+    heap.reserve(k);
+    for_each_in_range(around(p, r), [&](const Point &q) {
+        std::pair<double, Point> candidate(q.squaredDistance(p), q);
+        if (heap.size() < k) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end());
+        } else if (candidate < heap.front()) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end());
+        }
+    });
+    std::sort_heap(heap.begin(), heap.end());
+    std::vector<Point> result;
+    result.reserve(k);
+    for (const auto &candidate : heap) {
+        result.push_back(candidate.second);
+    }
+    return result;
+}
+
+Rect zorder::PointSet::around(const Point &center, double r) {
+    // Widened by a few rounding errors of the coordinates
+    double size = std::max(std::abs(center.x()), std::abs(center.y())) + r;
+    double d = r + 4 * std::numeric_limits<double>::epsilon() * size;
+    return Rect(Point(center.x() - d, center.y() - d), Point(center.x() + d, center.y() + d));
+}
+
+std::size_t zorder::PointSet::lowerBound(std::size_t i, const Code &c) const {
+    auto it = std::lower_bound(cells.begin() + static_cast<std::ptrdiff_t>(i), cells.end(), c,
+                               [](const Point &a, const Code &b) {
+                                   return less(code(a), b);
+                               });
+    return static_cast<std::size_t>(it - cells.begin());
+}
+
+std::size_t zorder::PointSet::skip(std::size_t i, const Code &c, const Code &low, const Code &high) const {
+    std::optional<Code> next = bigmin(c, low, high);
+    return next ? lowerBound(i + 1, *next) : cells.size();
+}
+
+void zorder::PointSet::sortCells() {
+    std::sort(cells.begin(), cells.end(), [](const Point &a, const Point &b) {
+        return less(code(a), code(b));
+    });
+    cells.erase(std::unique(cells.begin(), cells.end(), [](const Point &a, const Point &b) {
+        return code(a) == code(b);
+    }), cells.end());
+}
+
+void zorder::PointSet::insertAll(std::vector<Point> added) {
+    // Only the first of the points sharing a code counts, and only if the
+    // set doesn't have it yet
+    std::vector<std::size_t> order(added.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&added](std::size_t a, std::size_t b) {
+        return less(code(added[a]), code(added[b]));
+    });
+    std::vector<char> fresh(added.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        const Point &p = added[order[i]];
+        fresh[order[i]] = (i == 0 || code(added[order[i - 1]]) != code(p)) && !contains(p);
+    }
+    std::vector<Point> &all = ownPoints();
+    for (std::size_t i = 0; i < added.size(); ++i) {
+        if (fresh[i]) {
+            all.push_back(added[i]);
+        }
+    }
+    cells.insert(cells.end(), added.begin(), added.end());
+    sortCells();
+}
+
+std::optional<zorder::PointSet::Code> zorder::PointSet::bigmin(const Code &c, Code low, Code high) {
+    // Walks the bits of the curve from the top, y before x on each level,
+    // narrowing the box to the half the next code in it must lie in
+    std::optional<Code> result;
+    for (int level = 63; level >= 0; --level) {
+        for (int axis = 1; axis >= 0; --axis) {
+            std::uint64_t bit = std::uint64_t(1) << level;
+            std::uint64_t below = bit - 1;
+            bool cBit = c[axis] & bit, lowBit = low[axis] & bit, highBit = high[axis] & bit;
+            if (!cBit && !lowBit && highBit) {
+                // Either the upper half of the box, or a code in the lower one
+                Code upperHalf = low;
+                upperHalf[axis] = (low[axis] & ~(bit | below)) | bit;
+                result = upperHalf;
+                high[axis] = (high[axis] & ~(bit | below)) | below;
+            } else if (!cBit && lowBit) {
+                // The whole box is after c
+                return low;
+            } else if (cBit && !highBit) {
+                // The whole box is before c
+                return result;
+            } else if (cBit && !lowBit) {
+                low[axis] = (low[axis] & ~(bit | below)) | bit;
+            }
+        }
+    }
+    return result;
+}
@@ -1,10 +1,18 @@
 #include <gtest/gtest.h>
 #include "primitives.h"
+#include "static_kdtree.h"
+#include "grid.h"
+#include "quadtree.h"
+#include "rtree.h"
+#include "simd.h"
+#include "zorder.h"
 
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <set>
+#include <sstream>
+#include <thread>
 
 template <typename T>
 class PointSetTest : public ::testing::Test {
@@ -62,9 +70,85 @@ class PointSetTest : public ::testing::Test {
         T m_set;
 };
 
-using TestTypes = ::testing::Types<rbtree::PointSet, kdtree::PointSet>;
+// kd-tree keeping up to 16 points in a leaf
+class BucketPointSet : public kdtree::PointSet {
+    public:
+        BucketPointSet() : kdtree::PointSet(16) {}
+};
+
+// Bucketed kd-tree storing float coordinates in its leaves
+class CompactBucketPointSet : public kdtree::CompactPointSet {
+    public:
+        CompactBucketPointSet() : kdtree::CompactPointSet(16) {}
+};
+
+using TestTypes = ::testing::Types<rbtree::PointSet, kdtree::PointSet, BucketPointSet, CompactBucketPointSet,
+                                   zorder::PointSet, grid::PointSet, quadtree::PointSet>;
 TYPED_TEST_SUITE(PointSetTest, TestTypes);
 
+// Numbers in [0, 1) from a fixed seed, the same on every platform
+class Lcg {
+    public:
+        explicit Lcg(std::uint64_t seed) : seed(seed) {}
+
+        double operator()()
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            return static_cast<double>(seed >> 40) / (1 << 24);
+        }
+
+    private:
+        std::uint64_t seed;
+};
+
+// The points without repeats, in the order a set iterates them after
+// putting them one by one
+std::vector<Point> insertion_order(const std::vector<Point> & points)
+{
+    std::vector<Point> result;
+    std::set<Point> seen;
+    for (const Point & point : points) {
+        if (seen.insert(point).second) {
+            result.push_back(point);
+        }
+    }
+    return result;
+}
+
+// Checks range, within and the k nearest of a set against a scan of all its
+// points. Points at equal distances may come in any order.
+template<class Set>
+void check_searches(const Set & set, const std::set<Point> & reference, const Rect & r, const Point & q,
+                    double radius, std::size_t k)
+{
+    std::set<Point> expected;
+    std::copy_if(reference.begin(), reference.end(), std::inserter(expected, expected.end()),
+                 [&](const Point & point) { return r.contains(point); });
+    auto found = set.range(r);
+    ASSERT_EQ(std::set<Point>(found.first, found.second), expected);
+    ASSERT_EQ(std::distance(found.first, found.second), expected.size());
+
+    auto near = set.within(q, radius);
+    ASSERT_EQ(std::distance(near.first, near.second),
+              std::count_if(reference.begin(), reference.end(), [&](const Point & point) {
+                  return point.squaredDistance(q) <= radius * radius;
+              }));
+
+    std::vector<Point> sorted(reference.begin(), reference.end());
+    std::sort(sorted.begin(), sorted.end(), [&](const Point & a, const Point & b) {
+        return a.squaredDistance(q) < b.squaredDistance(q);
+    });
+    auto nearest = set.nearest(q, k);
+    ASSERT_EQ(std::distance(nearest.first, nearest.second), std::min(k, sorted.size()));
+    ASSERT_TRUE(std::equal(nearest.first, nearest.second, sorted.begin(),
+                           [&](const Point & a, const Point & b) {
+                               return a.squaredDistance(q) == b.squaredDistance(q);
+                           }));
+    if (!sorted.empty()) {
+        ASSERT_EQ(set.nearest(q)->squaredDistance(q), sorted[0].squaredDistance(q));
+    }
+}
+
 
 TEST(PointSetTest, Point)
 {
@@ -73,6 +157,7 @@ TEST(PointSetTest, Point)
     ASSERT_DOUBLE_EQ(Point(0, 0).distance(Point(1, 0)), 1.);
     ASSERT_DOUBLE_EQ(Point(0, 0).distance(Point(0, 1)), 1.);
     ASSERT_DOUBLE_EQ(Point(0, 4).distance(Point(3, 0)), 5.);
+    ASSERT_DOUBLE_EQ(Point(0, 4).squaredDistance(Point(3, 0)), 25.);
 }
 
 TEST(PointSetTest, Rect)
@@ -89,6 +174,10 @@ TEST(PointSetTest, Rect)
     ASSERT_DOUBLE_EQ(r.distance(Point(2., 3.)), 1.);
     ASSERT_DOUBLE_EQ(r.distance(Point(4., 1.2)), 2.);
     ASSERT_DOUBLE_EQ(r.distance(Point(1.1, -1)), 2.);
+    ASSERT_DOUBLE_EQ(r.distance(Point(5., 6.)), 5.);
+    ASSERT_DOUBLE_EQ(r.squaredDistance(Point(1.5, 1.5)), 0.);
+    ASSERT_DOUBLE_EQ(r.squaredDistance(Point(0., 0.)), 2.);
+    ASSERT_DOUBLE_EQ(r.squaredDistance(Point(1.5, 4.)), 4.);
     ASSERT_TRUE(r.contains(Point(1.5, 1.5)));
     ASSERT_FALSE(r.contains(Point(.9, 1.5)));
     ASSERT_TRUE(r.intersects(Rect(Point(0., 0.), Point(1.5, 1.5))));
@@ -383,3 +472,1029 @@ TYPED_TEST(PointSetTest, NearestForwardIterator)
         ++it2;
     }
 }
+
+TYPED_TEST(PointSetTest, IteratorSnapshot)
+{
+    auto & p = this->m_set;
+    p.put(Point(0., 0.));
+    p.put(Point(1., 1.));
+
+    auto begin = p.begin(), end = p.end();
+    auto copy = p;
+    p.put(Point(.5, .5));
+    copy.put(Point(.2, .2));
+
+    ASSERT_EQ(std::distance(begin, end), 2);
+    ASSERT_EQ(*begin, Point(0., 0.));
+    ASSERT_EQ(*std::next(begin), Point(1., 1.));
+    ASSERT_EQ(p.size(), 3);
+    ASSERT_EQ(copy.size(), 3);
+    ASSERT_TRUE(p.contains(Point(.5, .5)));
+    ASSERT_FALSE(copy.contains(Point(.5, .5)));
+    this->check_size(3);
+
+    std::ostringstream os;
+    os << copy;
+    ASSERT_EQ(os.str(), "{(0 , 0)(1 , 1)(0.2 , 0.2)}");
+}
+
+TYPED_TEST(PointSetTest, RangeIntoBuffer)
+{
+    this->load_data("test/etc/test1.dat");
+    const auto & p = this->m_set;
+    Rect r(Point(0.634, 0.276), Point(.818, .42));
+
+    std::vector<Point> buffer(1, Point(-1., -1.));
+    p.range(r, std::back_inserter(buffer));
+    ASSERT_EQ(buffer.size(), 4);
+    auto expected = this->to_set(p.range(r));
+    ASSERT_EQ(std::set<Point>(buffer.begin() + 1, buffer.end()), expected);
+
+    std::size_t count = 0;
+    p.for_each_in_range(r, [&](const Point & point) {
+        ASSERT_TRUE(r.contains(point));
+        ++count;
+    });
+    ASSERT_EQ(count, 3);
+
+    Point nearest[3];
+    auto end = p.nearest(Point(.74, .29), 3, nearest);
+    ASSERT_EQ(end, nearest + 3);
+    auto k = p.nearest(Point(.74, .29), 3);
+    ASSERT_TRUE(std::equal(nearest, end, k.first, k.second));
+    ASSERT_EQ(nearest[0], *p.nearest(Point(.74, .29)));
+}
+
+TYPED_TEST(PointSetTest, Within)
+{
+    this->load_data("test/etc/test1.dat");
+    const auto & p = this->m_set;
+    for (double r : {-1., 0., .05, .2, 2.}) {
+        Point center(.7, .35);
+        std::set<Point> expected;
+        for (const Point & point : p) {
+            if (point.distance(center) <= r) {
+                expected.insert(point);
+            }
+        }
+        auto found = p.within(center, r);
+        ASSERT_EQ(this->to_set(found), expected);
+        ASSERT_EQ(std::distance(found.first, found.second), expected.size());
+    }
+    auto first = *p.begin();
+    ASSERT_EQ(this->to_set(p.within(first, 0)), std::set<Point>{first});
+}
+
+TYPED_TEST(PointSetTest, WithinOnCircle)
+{
+    // 0.2 + 0.7 rounds to 0.8999999999999999, short of the point at 0.9
+    auto & p = this->m_set;
+    p.put(Point(0.9, 0));
+    p.put(Point(0.5, 0.1));
+    p.put(Point(2, 0));
+    auto found = p.within(Point(0.2, 0), 0.7);
+    ASSERT_EQ(this->to_set(found), (std::set<Point>{Point(0.9, 0), Point(0.5, 0.1)}));
+}
+
+std::vector<Point> load_points(const std::string & filename)
+{
+    std::vector<Point> res;
+    std::ifstream fs(filename);
+    double x, y;
+    while (fs >> x >> y) {
+        res.emplace_back(x, y);
+    }
+    return res;
+}
+
+TEST(KdTreeTest, BulkBuild)
+{
+    auto points = load_points("test/etc/test2.dat");
+    ASSERT_EQ(points.size(), 120);
+    points.push_back(points.front());
+
+    kdtree::PointSet p(points.begin(), points.end());
+    ASSERT_EQ(p.size(), 120);
+    for (const auto & point : points) {
+        ASSERT_TRUE(p.contains(point));
+    }
+    ASSERT_FALSE(p.contains(Point(0.5, 0)));
+
+    auto n = p.nearest(Point(.712, .567));
+    ASSERT_TRUE(n.has_value());
+    ASSERT_EQ(Point(0.718, 0.555), *n);
+
+    auto range = p.range(Rect(Point(0., 0.), Point(1., 1.)));
+    ASSERT_EQ(std::set<Point>(range.first, range.second).size(), 120);
+
+    p.build(points.begin(), points.begin());
+    ASSERT_EQ(p.size(), 120);
+    p.put(Point(2., 2.));
+    std::vector<Point> more {Point(3., 3.), Point(2., 2.)};
+    p.build(more.begin(), more.end());
+    ASSERT_EQ(p.size(), 122);
+    ASSERT_TRUE(p.contains(Point(2., 2.)));
+    ASSERT_TRUE(p.contains(Point(3., 3.)));
+
+    // Iteration follows insertion across builds, as for the other backends
+    std::vector<Point> all = insertion_order(points);
+    all.push_back(Point(2., 2.));
+    all.push_back(Point(3., 3.));
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), all);
+    kdtree::CompactPointSet compact(points.rbegin(), points.rend());
+    std::vector<Point> reversed(points.rbegin(), points.rend());
+    ASSERT_EQ(std::vector<Point>(compact.begin(), compact.end()), insertion_order(reversed));
+}
+
+TEST(KdTreeTest, StaticPointSet)
+{
+    auto points = load_points("test/etc/test2.dat");
+    rbtree::PointSet reference;
+    for (const auto & point : points) {
+        reference.put(point);
+    }
+    points.push_back(points.back());
+
+    kdtree::StaticPointSet p(points);
+    ASSERT_EQ(p.size(), 120);
+    ASSERT_EQ(std::set<Point>(p.begin(), p.end()).size(), 120);
+    for (const auto & point : points) {
+        ASSERT_TRUE(p.contains(point));
+    }
+    ASSERT_FALSE(p.contains(Point(0.5, 0)));
+
+    ASSERT_EQ(Point(0.718, 0.555), *p.nearest(Point(.712, .567)));
+    for (double x = -0.1; x < 1.1; x += 0.13) {
+        for (double y = -0.1; y < 1.1; y += 0.17) {
+            ASSERT_EQ(p.nearest(Point(x, y))->distance(Point(x, y)),
+                      reference.nearest(Point(x, y))->distance(Point(x, y)));
+            Rect r(Point(x, y), Point(x + 0.3, y + 0.2));
+            auto expected = reference.range(r);
+            auto actual = p.range(r);
+            ASSERT_EQ(std::set<Point>(actual.first, actual.second),
+                      std::set<Point>(expected.first, expected.second));
+        }
+    }
+
+    auto range = p.nearest(Point(.386, .759), 3);
+    std::vector<Point> k(range.first, range.second);
+    ASSERT_EQ(k.size(), 3);
+    ASSERT_EQ(k[0], Point(0.376, 0.767));
+    ASSERT_EQ(k[1], Point(0.409, 0.754));
+    ASSERT_EQ(k[2], Point(0.408, 0.728));
+    range = p.nearest(Point(.386, .759), 210);
+    ASSERT_EQ(std::set<Point>(range.first, range.second).size(), 120);
+
+    kdtree::StaticPointSet e;
+    ASSERT_TRUE(e.empty());
+    ASSERT_FALSE(e.nearest(Point(0, 0)).has_value());
+    ASSERT_EQ(e.begin(), e.end());
+}
+
+TEST(KdTreeTest, ConcurrentNearest)
+{
+    kdtree::PointSet p;
+    for (const auto & point : load_points("test/etc/test2.dat")) {
+        p.put(point);
+    }
+    auto expected = p.nearest(Point(.386, .759), 10);
+    std::vector<Point> sorted(expected.first, expected.second);
+    ASSERT_EQ(sorted.size(), 10);
+    for (std::size_t i = 1; i < sorted.size(); ++i) {
+        ASSERT_LE(sorted[i - 1].distance(Point(.386, .759)), sorted[i].distance(Point(.386, .759)));
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<char> same(4);
+    for (std::size_t t = 0; t < same.size(); ++t) {
+        threads.emplace_back([&, t] {
+            bool ok = true;
+            for (int i = 0; i < 200; ++i) {
+                auto range = p.nearest(Point(.386, .759), 10);
+                ok = ok && std::equal(range.first, range.second, sorted.begin(), sorted.end());
+            }
+            same[t] = ok;
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(std::count(same.begin(), same.end(), 1), 4);
+}
+
+TEST(KdTreeTest, Batch)
+{
+    auto points = load_points("test/etc/test2.dat");
+    kdtree::PointSet p(points.begin(), points.end());
+
+    std::vector<Point> queries;
+    std::vector<Rect> rects;
+    for (int i = 0; i < 1000; ++i) {
+        double x = (i * 37 % 101) / 100., y = (i * 61 % 103) / 102.;
+        queries.emplace_back(x, y);
+        rects.emplace_back(Point(x, y), Point(x + .1, y + .2));
+    }
+
+    for (auto order : {BatchOrder::Arrival, BatchOrder::Morton, BatchOrder::Hilbert})
+    for (std::size_t threads : {1, 3, 0}) {
+        auto nearest = p.nearest_batch(queries, 4, threads, order);
+        ASSERT_EQ(nearest.size(), queries.size());
+        ASSERT_EQ(nearest.points.size(), 4 * queries.size());
+        auto range = p.range_batch(rects, threads, order);
+        ASSERT_EQ(range.size(), rects.size());
+        for (std::size_t i = 0; i < queries.size(); ++i) {
+            auto expected = p.nearest(queries[i], 4);
+            ASSERT_TRUE(std::equal(nearest[i].first, nearest[i].second, expected.first, expected.second));
+            auto inside = p.range(rects[i]);
+            ASSERT_TRUE(std::equal(range[i].first, range[i].second, inside.first, inside.second));
+        }
+    }
+
+    auto none = p.range_batch({});
+    ASSERT_EQ(none.size(), 0);
+    ASSERT_TRUE(none.points.empty());
+}
+
+TEST(PointSetTest, CurveKeys)
+{
+    ASSERT_EQ(quantize(-1., 0., 1.), 0);
+    ASSERT_EQ(quantize(2., 0., 1.), std::numeric_limits<std::uint32_t>::max());
+    ASSERT_EQ(mortonKey(0, 0), 0);
+    ASSERT_EQ(mortonKey(1, 0), 1);
+    ASSERT_EQ(mortonKey(0, 1), 2);
+    ASSERT_EQ(mortonKey(3, 3), 15);
+    ASSERT_EQ(mortonKey(0xFFFFFFFF, 0xFFFFFFFF), std::numeric_limits<std::uint64_t>::max());
+
+    // Neighbouring cells of the curve are neighbours on the grid
+    std::vector<std::pair<std::uint64_t, std::pair<std::uint32_t, std::uint32_t>>> cells;
+    for (std::uint32_t x = 0; x < 16; ++x) {
+        for (std::uint32_t y = 0; y < 16; ++y) {
+            cells.emplace_back(hilbertKey(x << 28, y << 28), std::pair(x, y));
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    for (std::size_t i = 1; i < cells.size(); ++i) {
+        auto [x0, y0] = cells[i - 1].second;
+        auto [x1, y1] = cells[i].second;
+        ASSERT_EQ(std::abs(int(x0) - int(x1)) + std::abs(int(y0) - int(y1)), 1);
+    }
+}
+
+TEST(KdTreeTest, Buckets)
+{
+    auto points = load_points("test/etc/test2.dat");
+    // Many points sharing a coordinate must still be split apart
+    for (int i = 0; i < 40; ++i) {
+        points.emplace_back(0.5, i / 40.);
+        points.emplace_back(i / 40., 0.25);
+    }
+    std::set<Point> reference(points.begin(), points.end());
+
+    for (std::size_t bucket : {1, 2, 7, 64}) {
+        kdtree::PointSet built(points.begin(), points.end(), bucket);
+        kdtree::PointSet grown(bucket);
+        for (const auto & point : points) {
+            grown.put(point);
+        }
+        ASSERT_EQ(built.size(), reference.size());
+        ASSERT_EQ(grown.size(), reference.size());
+        for (const auto & point : points) {
+            ASSERT_TRUE(built.contains(point));
+            ASSERT_TRUE(grown.contains(point));
+        }
+        for (double x = -0.1; x < 1.1; x += 0.13) {
+            for (double y = -0.1; y < 1.1; y += 0.17) {
+                Point q(x, y);
+                Rect r(q, Point(x + 0.3, y + 0.2));
+                ASSERT_NO_FATAL_FAILURE(check_searches(built, reference, r, q, 0.1, 5));
+                ASSERT_NO_FATAL_FAILURE(check_searches(grown, reference, r, q, 0.1, 5));
+            }
+        }
+    }
+}
+
+TEST(PointSetTest, DistanceKernels)
+{
+    std::vector<double> xs, ys;
+    for (int i = 0; i < 203; ++i) {
+        xs.push_back((i * 37 % 101) / 100.);
+        ys.push_back((i * 61 % 103) / 102.);
+    }
+    ASSERT_NE(simd::detail::kernelsFor("scalar"), nullptr);
+    ASSERT_NE(simd::detail::kernelsFor(simd::kernelName()), nullptr);
+    ASSERT_EQ(simd::detail::kernelsFor("sse9"), nullptr);
+    // Every version this CPU runs, not only the one picked for it
+    for (const char *name : {"scalar", "avx2", "avx512"}) {
+        const simd::detail::Kernels *kernels = simd::detail::kernelsFor(name);
+        if (kernels == nullptr) {
+            continue;
+        }
+        std::vector<double> out(xs.size());
+        for (std::size_t n : {0, 1, 3, 4, 7, 8, 9, 17, 203}) {
+            kernels->distances(xs.data(), ys.data(), n, .3, .6, out.data());
+            for (std::size_t i = 0; i < n; ++i) {
+                // Exactly, so that every kernel orders points the same way
+                ASSERT_EQ(out[i], Point(xs[i], ys[i]).squaredDistance(Point(.3, .6))) << name;
+            }
+            if (n == 0) {
+                continue;
+            }
+            std::size_t best = 0;
+            for (std::size_t i = 1; i < n; ++i) {
+                if (out[i] < out[best]) {
+                    best = i;
+                }
+            }
+            double distance;
+            ASSERT_EQ(kernels->nearest(xs.data(), ys.data(), n, .3, .6, distance), best) << name;
+            ASSERT_EQ(distance, out[best]);
+        }
+        // Ties go to the first point
+        std::vector<double> same(20, 1.);
+        double distance;
+        ASSERT_EQ(kernels->nearest(same.data(), same.data(), same.size(), 0., 0., distance), 0) << name;
+    }
+}
+
+TEST(KdTreeTest, SortedInput)
+{
+    // Sorted input would make a list-shaped tree without the rebalancing
+    kdtree::PointSet p;
+    const int n = 20000;
+    for (int i = 0; i < n; ++i) {
+        p.put(Point(i, i));
+    }
+    ASSERT_EQ(p.size(), n);
+    ASSERT_TRUE(p.contains(Point(n - 1, n - 1)));
+    ASSERT_FALSE(p.contains(Point(n, n)));
+    ASSERT_EQ(*p.nearest(Point(n + 10., n + 10.)), Point(n - 1, n - 1));
+    ASSERT_EQ(*p.nearest(Point(12.4, 12.6)), Point(12, 12));
+    auto range = p.range(Rect(Point(100.5, 0), Point(110, n)));
+    ASSERT_EQ(std::distance(range.first, range.second), 10);
+}
+
+TEST(KdTreeTest, BoundedDepth)
+{
+    for (std::size_t bucket : {1, 16}) {
+        Tree tree(bucket);
+        const int n = 20000;
+        for (int i = 0; i < n; ++i) {
+            // Sorted, then one corner at a time
+            tree.put(i < n / 2 ? Point(i, i) : Point(-i, i % 7));
+        }
+        std::size_t depth = 0, count = 0;
+        std::vector<std::pair<std::uint32_t, std::size_t>> stack{{tree.getRoot(), 0}};
+        while (!stack.empty()) {
+            auto [index, d] = stack.back();
+            stack.pop_back();
+            const Node &node = tree.getNode(index);
+            if (node.isLeaf()) {
+                depth = std::max(depth, d);
+                count += node.getCount();
+            } else {
+                ASSERT_EQ(node.getCount(), tree.getNode(node.getLeftNode()).getCount()
+                                           + tree.getNode(node.getRightNode()).getCount());
+                stack.emplace_back(node.getLeftNode(), d + 1);
+                stack.emplace_back(node.getRightNode(), d + 1);
+            }
+        }
+        ASSERT_EQ(count, n);
+        ASSERT_LE(depth, std::log(2. * n / bucket + 1) / -std::log(Tree::balance) + 1);
+    }
+}
+
+TEST(PointSetTest, CrossingRects)
+{
+    Rect wide(Point(0, 1), Point(3, 2)), tall(Point(1, 0), Point(2, 3));
+    ASSERT_TRUE(wide.intersects(tall));
+    ASSERT_TRUE(tall.intersects(wide));
+    ASSERT_FALSE(wide.intersects(Rect(Point(4, 0), Point(5, 3))));
+    ASSERT_TRUE(wide.contains(Rect(Point(1, 1.5), Point(2, 2))));
+    ASSERT_FALSE(wide.contains(tall));
+}
+
+TEST(KdTreeTest, ClusteredBoxes)
+{
+    // Two far apart clusters leave a large gap that only tight boxes skip
+    kdtree::PointSet grown, bucketed(8);
+    std::vector<Point> points;
+    for (int i = 0; i < 3000; ++i) {
+        double shift = i % 2 == 0 ? 0 : 1000;
+        points.emplace_back(shift + (i * 37 % 211) / 210., shift + (i * 61 % 197) / 196.);
+    }
+    for (const Point &p : points) {
+        grown.put(p);
+        bucketed.put(p);
+    }
+    kdtree::PointSet built(points.begin(), points.end(), 8);
+    std::set<Point> reference(points.begin(), points.end());
+    for (int i = 0; i < 50; ++i) {
+        Point q(i * 21.7 - 20, 1010 - i * 19.3);
+        Rect r(Point(q.x() - 300, 0.2), Point(q.x() + 700, q.y()));
+        for (const kdtree::PointSet *set : {&grown, &bucketed, &built}) {
+            ASSERT_NO_FATAL_FAILURE(check_searches(*set, reference, r, q, 400, 5));
+        }
+    }
+}
+
+TEST(KdTreeTest, Erase)
+{
+    for (std::size_t bucket : {1, 8}) {
+        kdtree::PointSet p(bucket);
+        std::set<Point> reference;
+        for (int i = 0; i < 4000; ++i) {
+            Point point((i * 37 % 397) / 10., (i * 91 % 401) / 10.);
+            p.put(point);
+            reference.insert(point);
+            if (i % 3 == 2) {
+                Point gone((i * 53 % 397) / 10., (i * 17 % 401) / 10.);
+                ASSERT_EQ(p.erase(gone), reference.erase(gone) == 1);
+            }
+        }
+        ASSERT_FALSE(p.erase(Point(-1, -1)));
+        Rect hole(Point(5, 5), Point(25.5, 30));
+        std::size_t inside = std::count_if(reference.begin(), reference.end(), [&](const Point &q) {
+            return hole.contains(q);
+        });
+        ASSERT_EQ(p.erase_range(hole), inside);
+        ASSERT_EQ(p.erase_range(hole), 0);
+        for (auto it = reference.begin(); it != reference.end();) {
+            it = hole.contains(*it) ? reference.erase(it) : std::next(it);
+        }
+        ASSERT_EQ(p.size(), reference.size());
+        ASSERT_EQ(std::set<Point>(p.begin(), p.end()), reference);
+        for (int i = 0; i < 30; ++i) {
+            Point q(i * 1.37, 40 - i * 1.21);
+            ASSERT_EQ(p.contains(q), reference.count(q) == 1);
+            Rect r(Point(q.x() - 4, q.y() - 9), Point(q.x() + 6, q.y() + 3));
+            ASSERT_NO_FATAL_FAILURE(check_searches(p, reference, r, q, 2, 5));
+        }
+        // Emptying the set and filling it again
+        ASSERT_EQ(p.erase_range(Rect(Point(-1, -1), Point(100, 100))), reference.size());
+        ASSERT_TRUE(p.empty());
+        ASSERT_FALSE(p.nearest(Point(0, 0)));
+        p.put(Point(3, 4));
+        ASSERT_EQ(*p.nearest(Point(0, 0)), Point(3, 4));
+    }
+}
+
+TEST(KdTreeTest, Count)
+{
+    for (std::size_t bucket : {1, 16}) {
+        kdtree::PointSet p(bucket);
+        ASSERT_EQ(p.count(Rect(Point(0, 0), Point(1, 1))), 0);
+        for (int i = 0; i < 3000; ++i) {
+            p.put(Point((i * 37 % 499) / 10., (i * 61 % 503) / 10.));
+        }
+        p.erase_range(Rect(Point(10, 10), Point(20, 20)));
+        ASSERT_EQ(p.count(Rect(Point(-1, -1), Point(100, 100))), p.size());
+        for (int i = 0; i < 40; ++i) {
+            Rect r(Point(i * 1.1, 50 - i * 1.3), Point(i * 1.1 + i % 7 * 3, 50 - i * 1.3 + i % 5 * 4));
+            auto found = p.range(r);
+            ASSERT_EQ(p.count(r), std::distance(found.first, found.second));
+        }
+    }
+}
+
+TEST(KdTreeTest, NearestApprox)
+{
+    for (std::size_t bucket : {1, 8}) {
+        kdtree::PointSet p(bucket);
+        for (int i = 0; i < 3000; ++i) {
+            p.put(Point((i * 37 % 499) / 10., (i * 61 % 503) / 10.));
+        }
+        for (int i = 0; i < 40; ++i) {
+            Point q(i * 1.23 - 1, 51 - i * 1.31);
+            auto exact = p.nearest(q, 5);
+            for (double eps : {0., .1, 1.}) {
+                auto approx = p.nearest_approx(q, 5, eps);
+                ASSERT_EQ(std::distance(approx.first, approx.second), 5);
+                auto e = exact.first;
+                for (auto a = approx.first; a != approx.second; ++a, ++e) {
+                    ASSERT_LE(a->distance(q), (1 + eps) * e->distance(q) + 1e-12);
+                }
+            }
+            auto same = p.nearest_approx(q, 5, 0);
+            ASSERT_TRUE(std::equal(same.first, same.second, exact.first, exact.second,
+                                   [&](const Point &a, const Point &b) { return a.distance(q) == b.distance(q); }));
+            // A budget of one node only enters the root, which holds no points itself
+            auto root = p.nearest_approx(q, 5, 0, 1);
+            ASSERT_EQ(root.first, root.second);
+            auto capped = p.nearest_approx(q, 5, 0, 30);
+            ASSERT_LE(std::distance(capped.first, capped.second), 5);
+            ASSERT_GE(std::distance(capped.first, capped.second), 1);
+        }
+    }
+}
+
+TEST(KdTreeTest, Neighbours)
+{
+    for (std::size_t bucket : {1, 8}) {
+        kdtree::PointSet p(bucket);
+        ASSERT_EQ(p.neighbours(Point(0, 0)).first, p.neighbours(Point(0, 0)).second);
+        for (int i = 0; i < 2000; ++i) {
+            p.put(Point((i * 37 % 499) / 10., (i * 61 % 503) / 10.));
+        }
+        p.erase_range(Rect(Point(0, 0), Point(10, 10)));
+        for (int i = 0; i < 20; ++i) {
+            Point q(i * 2.3 - 1, 51 - i * 2.1);
+            auto all = p.neighbours(q);
+            std::vector<Point> walked(all.first, all.second);
+            ASSERT_EQ(walked.size(), p.size());
+            ASSERT_EQ(std::set<Point>(walked.begin(), walked.end()), std::set<Point>(p.begin(), p.end()));
+            auto k = p.nearest(q, 10);
+            ASSERT_TRUE(std::equal(k.first, k.second, walked.begin(), walked.begin() + 10,
+                                   [&](const Point &a, const Point &b) { return a.distance(q) == b.distance(q); }));
+            ASSERT_TRUE(std::is_sorted(walked.begin(), walked.end(), [&](const Point &a, const Point &b) {
+                return a.squaredDistance(q) < b.squaredDistance(q);
+            }));
+            // Walking out until a point passes the test
+            auto far = std::find_if(p.neighbours(q).first, kdtree::NeighbourIterator(), [&](const Point &x) {
+                return x.distance(q) > 3;
+            });
+            ASSERT_TRUE(far->distance(q) > 3);
+        }
+    }
+}
+
+TEST(KdTreeTest, ThreeDimensions)
+{
+    using Point3 = BasicPoint<3, float>;
+    using Rect3 = BasicRect<3, float>;
+    kdtree::BasicPointSet<3, float> p(4);
+    std::vector<Point3> reference;
+    for (int i = 0; i < 2000; ++i) {
+        Point3 point((i * 37 % 101) / 10.f, (i * 61 % 103) / 10.f, (i * 17 % 107) / 10.f);
+        p.put(point);
+        if (std::find(reference.begin(), reference.end(), point) == reference.end()) {
+            reference.push_back(point);
+        }
+    }
+    ASSERT_EQ(p.size(), reference.size());
+    ASSERT_TRUE(p.contains(reference[5]));
+    ASSERT_FALSE(p.contains(Point3(-1, 0, 0)));
+    for (int i = 0; i < 20; ++i) {
+        Point3 q(i * .5f, 10 - i * .5f, i * .3f);
+        auto byDistance = [&](const Point3 &a, const Point3 &b) {
+            return a.squaredDistance(q) < b.squaredDistance(q);
+        };
+        std::sort(reference.begin(), reference.end(), byDistance);
+        ASSERT_EQ(p.nearest(q)->squaredDistance(q), reference[0].squaredDistance(q));
+        auto k = p.nearest(q, 7);
+        ASSERT_TRUE(std::equal(k.first, k.second, reference.begin(), reference.begin() + 7,
+                               [&](const Point3 &a, const Point3 &b) {
+                                   return a.squaredDistance(q) == b.squaredDistance(q);
+                               }));
+        auto walk = p.neighbours(q);
+        ASSERT_EQ(walk.first->squaredDistance(q), reference[0].squaredDistance(q));
+
+        Rect3 r(Point3(q[0] - 2, q[1] - 1, q[2] - 3), Point3(q[0] + 1, q[1] + 2, q[2] + 1));
+        std::set<Point3> expected;
+        std::copy_if(reference.begin(), reference.end(), std::inserter(expected, expected.end()),
+                     [&](const Point3 &x) { return r.contains(x); });
+        auto found = p.range(r);
+        ASSERT_EQ(std::set<Point3>(found.first, found.second), expected);
+        ASSERT_EQ(p.count(r), expected.size());
+        auto near = p.within(q, 1.5);
+        ASSERT_EQ(std::distance(near.first, near.second),
+                  std::count_if(reference.begin(), reference.end(), [&](const Point3 &x) {
+                      return x.distance(q) <= 1.5;
+                  }));
+    }
+    auto batch = p.nearest_batch({Point3(1, 2, 3), Point3(4, 5, 6)}, 2, 1, BatchOrder::Hilbert);
+    ASSERT_EQ(batch.size(), 2);
+    ASSERT_EQ(*batch[1].first, *p.nearest(Point3(4, 5, 6)));
+    ASSERT_TRUE(p.erase(reference[0]));
+    ASSERT_FALSE(p.contains(reference[0]));
+}
+
+TEST(KdTreeTest, Compact)
+{
+    // Neighbouring points differ far below float precision
+    kdtree::PointSet exact(8);
+    kdtree::CompactPointSet compact(8);
+    std::vector<Point> points;
+    for (int i = 0; i < 3000; ++i) {
+        points.emplace_back(1000 + (i % 60) * 1e-9, -500 + (i / 60) * 3e-10);
+    }
+    std::vector<Point> half(points.begin(), points.begin() + 1500);
+    compact.build(half.begin(), half.end());
+    exact.build(half.begin(), half.end());
+    for (auto it = points.begin() + 1500; it != points.end(); ++it) {
+        compact.put(*it);
+        exact.put(*it);
+    }
+    ASSERT_EQ(compact.size(), exact.size());
+    ASSERT_TRUE(std::equal(compact.begin(), compact.end(), exact.begin(), exact.end()));
+    ASSERT_TRUE(compact.contains(points[1234]));
+    ASSERT_FALSE(compact.contains(Point(1000 + 5e-10, -500)));
+
+    auto check = [&](const Point &q) {
+        auto byDistance = [&](const Point &a, const Point &b) {
+            return a.squaredDistance(q) < b.squaredDistance(q);
+        };
+        // Query bounds lying exactly on stored points
+        Rect r(Point(points[61].x(), points[130].y()), Point(points[1787].x(), points[2403].y()));
+        std::vector<Point> a, b;
+        compact.range(r, std::back_inserter(a));
+        exact.range(r, std::back_inserter(b));
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        ASSERT_EQ(a, b);
+        ASSERT_EQ(compact.count(r), exact.count(r));
+
+        double radius = q.distance(points[1000]);
+        a.clear();
+        b.clear();
+        compact.within(q, radius, std::back_inserter(a));
+        exact.within(q, radius, std::back_inserter(b));
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        ASSERT_EQ(a, b);
+
+        a.clear();
+        b.clear();
+        compact.nearest(q, 10, std::back_inserter(a));
+        exact.nearest(q, 10, std::back_inserter(b));
+        ASSERT_TRUE(std::equal(a.begin(), a.end(), b.begin(), b.end(), [&](const Point &x, const Point &y) {
+            return x.squaredDistance(q) == y.squaredDistance(q);
+        }));
+        ASSERT_EQ(compact.nearest(q)->squaredDistance(q), exact.nearest(q)->squaredDistance(q));
+        ASSERT_TRUE(std::is_sorted(a.begin(), a.end(), byDistance));
+        ASSERT_EQ(compact.neighbours(q).first->squaredDistance(q), a[0].squaredDistance(q));
+    };
+    check(Point(1000 + 2.5e-8, -500 + 7e-9));
+    check(points[777]);
+
+    ASSERT_TRUE(compact.erase(points[61]));
+    ASSERT_TRUE(exact.erase(points[61]));
+    Rect cut(Point(1000, -500 + 5e-9), Point(1000 + 3e-8, -500 + 9e-9));
+    ASSERT_EQ(compact.erase_range(cut), exact.erase_range(cut));
+    ASSERT_TRUE(std::equal(compact.begin(), compact.end(), exact.begin(), exact.end()));
+    ASSERT_FALSE(compact.contains(points[61]));
+    check(Point(1000 + 1e-8, -500 + 6e-9));
+    for (std::size_t i = 0; i < points.size(); i += 2) {
+        compact.erase(points[i]);
+        exact.erase(points[i]);
+    }
+    ASSERT_EQ(compact.size(), exact.size());
+    check(Point(1000, -500));
+}
+
+TEST(ZOrderTest, MatchesBruteForce)
+{
+    std::vector<Point> points;
+    Lcg next(12345);
+    for (int i = 0; i < 3000; ++i) {
+        // Both signs, with many points on the axes
+        double x = i % 7 == 0 ? 0 : next() * 20 - 10;
+        double y = i % 11 == 0 ? -0. : next() * 20 - 10;
+        points.emplace_back(x, y);
+    }
+    zorder::PointSet p(points.begin(), points.begin() + 2000);
+    for (auto it = points.begin() + 2000; it != points.end(); ++it) {
+        p.put(*it);
+    }
+    std::set<Point> reference(points.begin(), points.end());
+    ASSERT_EQ(p.size(), reference.size());
+    ASSERT_EQ(std::set<Point>(p.begin(), p.end()), reference);
+    // Iteration follows insertion, the first of equal points counting
+    std::vector<Point> inserted = insertion_order(points);
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), inserted);
+    p.build(points.begin() + 1000, points.end());
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), inserted);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(p.contains(points[i * 29]));
+    }
+    ASSERT_TRUE(p.contains(Point(-0., 0.)) == reference.count(Point(0., 0.)));
+    ASSERT_FALSE(p.contains(Point(10.5, 0)));
+
+    for (int i = 0; i < 200; ++i) {
+        double x = next() * 24 - 12, y = next() * 24 - 12;
+        Point q(x, y);
+        Rect r(Point(x, y), Point(x + next() * (i % 2 ? 1 : 12), y + next() * 3));
+        ASSERT_NO_FATAL_FAILURE(check_searches(p, reference, r, q, next() * 2, 9));
+    }
+    auto inverted = p.range(Rect(Point(1, 1), Point(0, 0)));
+    ASSERT_EQ(inverted.first, inverted.second);
+    ASSERT_FALSE(zorder::PointSet().nearest(Point(0, 0)));
+}
+
+TEST(GridTest, MatchesBruteForce)
+{
+    std::vector<Point> points;
+    Lcg next(777);
+    for (int i = 0; i < 2000; ++i) {
+        points.emplace_back(next(), next());
+    }
+    // A dense cluster, a line of equal x and points far out put one by one
+    for (int i = 0; i < 300; ++i) {
+        points.emplace_back(.5 + next() * 1e-4, .5 + next() * 1e-4);
+        points.emplace_back(.25, next());
+    }
+    points.emplace_back(-3, 2);
+    points.emplace_back(4, -1);
+    grid::PointSet p(points.begin(), points.begin() + 1000);
+    for (auto it = points.begin() + 1000; it != points.end(); ++it) {
+        p.put(*it);
+    }
+    std::set<Point> reference(points.begin(), points.end());
+    ASSERT_EQ(p.size(), reference.size());
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), insertion_order(points));
+    p.build(points.begin() + 500, points.end());
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), insertion_order(points));
+    ASSERT_TRUE(p.contains(points[1500]));
+    ASSERT_TRUE(p.contains(Point(4, -1)));
+    ASSERT_FALSE(p.contains(Point(.25, 2)));
+
+    for (int i = 0; i < 200; ++i) {
+        // Queries inside and well outside the grid
+        Point q(next() * 10 - 5, next() * 4 - 2);
+        if (i % 2 == 0) {
+            q = Point(next(), next());
+        }
+        Rect r(q, Point(q.x() + next() * .3, q.y() + next()));
+        ASSERT_NO_FATAL_FAILURE(check_searches(p, reference, r, q, next() * .2, 12));
+    }
+    ASSERT_FALSE(grid::PointSet().nearest(Point(0, 0)));
+
+    // 0.8 - 0.5 rounds to 0.30000000000000004, which falls in the column
+    // after the one of the point at 0.3 on the circle
+    std::vector<Point> lattice;
+    for (int i = 0; i < 10; ++i) {
+        lattice.emplace_back(i / 10., 0);
+        lattice.emplace_back(i / 10., .1);
+    }
+    grid::PointSet g(lattice.begin(), lattice.end());
+    ASSERT_NO_FATAL_FAILURE(check_searches(g, std::set<Point>(lattice.begin(), lattice.end()),
+                                           Rect(Point(.3, 0), Point(.8, 0)), Point(.8, 0), .5, 4));
+    auto onCircle = g.within(Point(.8, .1), .5);
+    ASSERT_EQ(std::count(onCircle.first, onCircle.second, Point(.3, .1)), 1);
+}
+
+TEST(QuadTreeTest, Clustered)
+{
+    std::vector<Point> points;
+    Lcg next(4242);
+    // Clusters of very different spreads, some far from the first point
+    for (int c = 0; c < 30; ++c) {
+        double cx = next() * 2000 - 1000, cy = next() * 2000 - 1000, spread = std::pow(10., -(c % 10));
+        for (int i = 0; i < 100; ++i) {
+            points.emplace_back(cx + next() * spread, cy + next() * spread);
+        }
+    }
+    // Points too close for any square to part
+    for (int i = 0; i < 20; ++i) {
+        points.emplace_back(1e-300 * i, 0);
+    }
+    quadtree::PointSet p(points.begin(), points.end(), 4);
+    std::set<Point> reference(points.begin(), points.end());
+    ASSERT_EQ(p.size(), reference.size());
+    ASSERT_TRUE(std::equal(p.begin(), p.end(), points.begin()));
+    for (const Point &point : points) {
+        ASSERT_TRUE(p.contains(point));
+    }
+    ASSERT_FALSE(p.contains(Point(5000, 0)));
+
+    for (int i = 0; i < 100; ++i) {
+        const Point &base = points[i * 29 % points.size()];
+        Point q(base.x() + next() - .5, base.y() + next() - .5);
+        Rect r(q, Point(q.x() + next() * 2, q.y() + next()));
+        ASSERT_NO_FATAL_FAILURE(check_searches(p, reference, r, q, next(), 10));
+    }
+    ASSERT_FALSE(quadtree::PointSet().nearest(Point(0, 0)));
+
+    // Points too far apart for the root to double up to, which used to loop forever
+    quadtree::PointSet extreme(2);
+    std::vector<Point> far{Point(0, 0), Point(1.5e308, 0), Point(-1.5e308, 0), Point(0, -1.7e308), Point(3, 4)};
+    for (const Point &point : far) {
+        extreme.put(point);
+    }
+    ASSERT_EQ(extreme.size(), far.size());
+    ASSERT_TRUE(std::equal(extreme.begin(), extreme.end(), far.begin()));
+    for (const Point &point : far) {
+        ASSERT_TRUE(extreme.contains(point));
+        ASSERT_EQ(*extreme.nearest(point), point);
+    }
+    ASSERT_NO_FATAL_FAILURE(check_searches(extreme, std::set<Point>(far.begin(), far.end()),
+                                           Rect(Point(-1e308, -1), Point(1e308, 5)), Point(1, 1), 5, 3));
+    ASSERT_THROW(extreme.put(Point(std::numeric_limits<double>::infinity(), 0)), std::invalid_argument);
+    ASSERT_THROW(extreme.put(Point(0, std::nan(""))), std::invalid_argument);
+    ASSERT_FALSE(extreme.contains(Point(std::numeric_limits<double>::infinity(), 0)));
+    ASSERT_EQ(extreme.size(), far.size());
+}
+
+TEST(RTreeTest, MatchesBruteForce)
+{
+    std::vector<Rect> rects;
+    Lcg next(99);
+    for (int i = 0; i < 5000; ++i) {
+        double x = next() * 100, y = next() * 100;
+        // Mostly small boxes, some long strips and single points
+        double w = i % 50 == 0 ? 40 * next() : next(), h = i % 7 == 0 ? 0 : next();
+        rects.emplace_back(Point(x, y), Point(x + w, y + h));
+    }
+    rects.push_back(rects[10]);
+    rtree::RectSet set(rects);
+    ASSERT_EQ(set.size(), rects.size());
+    auto order = [](const Rect &a, const Rect &b) {
+        return std::tuple(a.xmin(), a.ymin(), a.xmax(), a.ymax()) < std::tuple(b.xmin(), b.ymin(), b.xmax(), b.ymax());
+    };
+    auto sorted = [&order](std::vector<Rect> v) {
+        std::sort(v.begin(), v.end(), order);
+        return v;
+    };
+    ASSERT_EQ(sorted(std::vector<Rect>(set.begin(), set.end())), sorted(rects));
+
+    for (int i = 0; i < 200; ++i) {
+        Point p(next() * 110 - 5, next() * 110 - 5);
+        Rect q(p, Point(p.x() + next() * 3, p.y() + next() * 3));
+
+        std::vector<Rect> expected, found;
+        std::copy_if(rects.begin(), rects.end(), std::back_inserter(expected),
+                     [&](const Rect &r) { return r.intersects(q); });
+        set.intersecting(q, std::back_inserter(found));
+        ASSERT_EQ(sorted(found), sorted(expected));
+
+        expected.clear();
+        std::copy_if(rects.begin(), rects.end(), std::back_inserter(expected),
+                     [&](const Rect &r) { return r.contains(p); });
+        auto containing = set.containing(p);
+        ASSERT_EQ(sorted(std::vector<Rect>(containing.first, containing.second)), sorted(expected));
+
+        std::vector<Rect> byDistance = rects;
+        std::sort(byDistance.begin(), byDistance.end(), [&](const Rect &a, const Rect &b) {
+            return a.squaredDistance(p) < b.squaredDistance(p);
+        });
+        auto k = set.nearest(p, 7);
+        ASSERT_EQ(std::distance(k.first, k.second), 7);
+        ASSERT_TRUE(std::equal(k.first, k.second, byDistance.begin(), byDistance.begin() + 7,
+                               [&](const Rect &a, const Rect &b) {
+                                   return a.squaredDistance(p) == b.squaredDistance(p);
+                               }));
+        ASSERT_EQ(set.nearest(p)->squaredDistance(p), byDistance[0].squaredDistance(p));
+    }
+    // Both copies of a duplicated rectangle are found
+    auto corner = set.containing(Point(rects[10].xmin(), rects[10].ymax()));
+    ASSERT_EQ(std::count(corner.first, corner.second, rects[10]), 2);
+
+    rtree::RectSet empty;
+    ASSERT_TRUE(empty.empty());
+    ASSERT_FALSE(empty.nearest(Point(0, 0)));
+    auto none = empty.intersecting(Rect(Point(0, 0), Point(1, 1)));
+    ASSERT_EQ(none.first, none.second);
+
+    rtree::RectSet one(rects.begin(), rects.begin() + 1);
+    ASSERT_EQ(*one.nearest(Point(-1, -1)), rects[0]);
+    std::ostringstream os;
+    os << rtree::RectSet(std::vector<Rect>{Rect(Point(0, 0), Point(1, 2))});
+    ASSERT_EQ(os.str(), "{[(0 , 0) , (1 , 2)]}");
+}
+
+TEST(KdTreeTest, BatchPool)
+{
+    // A failing query stops its batch and the exception comes out of it
+    auto failing = [](std::size_t i, auto out) {
+        if (i == 700) {
+            throw std::runtime_error("query failed");
+        }
+        *out++ = Point(i, 0);
+    };
+    ASSERT_THROW(runBatch(1000, 4, failing), std::runtime_error);
+
+    // The pool lives on, and a query may run a batch of its own
+    auto nested = runBatch(64, 4, [](std::size_t i, auto out) {
+        auto inner = runBatch(32, 2, [i](std::size_t j, auto o) { *o++ = Point(i, j); });
+        *out++ = inner.points.back();
+    });
+    ASSERT_EQ(nested.size(), 64);
+    for (std::size_t i = 0; i < nested.size(); ++i) {
+        ASSERT_EQ(*nested[i].first, Point(i, 31));
+    }
+
+    // Without workers the caller runs every task itself
+    WorkerPool alone(0);
+    std::vector<std::size_t> ran;
+    alone.run(5, [&ran](std::size_t t) { ran.push_back(t); });
+    ASSERT_EQ(ran, (std::vector<std::size_t>{0, 1, 2, 3, 4}));
+    WorkerPool few(3);
+    std::vector<char> seen(100);
+    few.run(seen.size(), [&seen](std::size_t t) { seen[t] = 1; });
+    ASSERT_EQ(std::count(seen.begin(), seen.end(), 1), 100);
+    ASSERT_THROW(few.run(10, [](std::size_t t) {
+        if (t % 3 == 1) {
+            throw std::logic_error("task failed");
+        }
+    }), std::logic_error);
+}
+
+TEST(KdTreeTest, EraseScales)
+{
+    auto pointAt = [](std::size_t i) {
+        return Point(double(i * 7919 % 100003), double(i * 104729 % 100019));
+    };
+    // Mass erases leave holes in the insertion order buffer instead of
+    // shifting it, and compacting it once holes outnumber the points must
+    // keep both the order and the ids the tree hands back
+    auto expire = [&](auto p) {
+        const std::size_t n = 100000;
+        for (std::size_t i = 0; i < n; ++i) {
+            p.put(pointAt(i));
+        }
+        std::vector<Point> expected;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (i % 2 == 0) {
+                ASSERT_TRUE(p.erase(pointAt(i)));
+            } else {
+                expected.push_back(pointAt(i));
+            }
+        }
+        ASSERT_EQ(p.size(), n / 2);
+        ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), expected);
+        // Past several compactions, the newest points going first
+        while (expected.size() > 100) {
+            ASSERT_TRUE(p.erase(expected.back()));
+            expected.pop_back();
+        }
+        ASSERT_EQ(p.size(), expected.size());
+        ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), expected);
+        for (std::size_t i = n; i < n + 50; ++i) {
+            p.put(pointAt(i));
+            expected.push_back(pointAt(i));
+        }
+        ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), expected);
+        for (const Point &q : expected) {
+            ASSERT_EQ(*p.nearest(q), q);
+        }
+    };
+    expire(kdtree::PointSet(16));
+    expire(kdtree::CompactPointSet(16));
+
+    // Holes keep the insertion order and leave older iterators alone
+    kdtree::CompactPointSet p(4);
+    std::vector<Point> expected;
+    for (std::size_t i = 0; i < 1000; ++i) {
+        p.put(pointAt(i));
+    }
+    auto before = std::make_pair(p.begin(), p.end());
+    for (std::size_t i = 0; i < 1000; ++i) {
+        if (i % 3 == 0) {
+            ASSERT_TRUE(p.erase(pointAt(i)));
+        } else {
+            expected.push_back(pointAt(i));
+        }
+    }
+    ASSERT_EQ(std::distance(before.first, before.second), 1000);
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), expected);
+    p.erase_range(Rect(Point(0, 0), Point(50000, 100019)));
+    expected.erase(std::remove_if(expected.begin(), expected.end(), [](const Point &q) {
+        return q.x() <= 50000;
+    }), expected.end());
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), expected);
+    for (const Point &q : expected) {
+        ASSERT_TRUE(p.contains(q));
+        ASSERT_EQ(*p.nearest(q), q);
+    }
+    p.put(Point(-1, -1));
+    expected.push_back(Point(-1, -1));
+    ASSERT_EQ(std::vector<Point>(p.begin(), p.end()), expected);
+}
+
+TEST(KdTreeTest, CompactFootprint)
+{
+    Lcg next(17);
+    std::vector<Point> points;
+    for (int i = 0; i < 200000; ++i) {
+        points.emplace_back(next() * 2e6 - 1e6, next() * 2e6 - 1e6);
+    }
+    auto bytesPerPoint = [&points](const auto &set) {
+        EXPECT_EQ(set.size(), points.size());
+        return double(set.memory_usage()) / points.size();
+    };
+    double plain = bytesPerPoint(kdtree::PointSet(points.begin(), points.end()));
+    double bucket = bytesPerPoint(kdtree::PointSet(points.begin(), points.end(), 16));
+    double compact = bytesPerPoint(kdtree::CompactPointSet(points.begin(), points.end()));
+    // The exact copy in insertion order alone takes 16 bytes per point
+    ASSERT_LT(compact, 0.8 * bucket);
+    ASSERT_LT(compact, 0.5 * plain);
+
+    // Points closer than float can tell apart still get one leaf each way
+    kdtree::CompactPointSet close;
+    for (int i = 0; i < 100; ++i) {
+        close.put(Point(1 + i * 1e-12, 1));
+    }
+    close.put(Point(2, 1));
+    ASSERT_EQ(close.size(), 101);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(close.contains(Point(1 + i * 1e-12, 1)));
+        ASSERT_EQ(*close.nearest(Point(1 + i * 1e-12, 1)), Point(1 + i * 1e-12, 1));
+    }
+    auto inRange = close.range(Rect(Point(1 + 50e-12, 0), Point(1.5, 2)));
+    ASSERT_EQ(std::distance(inRange.first, inRange.second), 50);
+    for (int i = 0; i < 100; i += 2) {
+        ASSERT_TRUE(close.erase(Point(1 + i * 1e-12, 1)));
+    }
+    ASSERT_EQ(close.size(), 51);
+    auto nearest = close.nearest(Point(0, 1), 60);
+    ASSERT_EQ(std::distance(nearest.first, nearest.second), 51);
+}